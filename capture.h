@@ -0,0 +1,42 @@
+/**
+ * @file
+ *
+ * Format of the files written by sgestures-record and read by sgestures-replay.
+ *
+ * A capture is a TouchCaptureHeader followed by TouchCaptureChunks. Each chunk
+ * holds the bytes of the writer's stream returned by a single read along with
+ * when they were read, so the stream can be replayed with its original timing.
+ * The bytes are stored as is; splitting them into events is left to the reader.
+ */
+#ifndef LIB_SGESUTRES_CAPTURE_H_
+#define LIB_SGESUTRES_CAPTURE_H_
+
+#include <stdint.h>
+
+/// "SGCP" when little endian
+#define TOUCH_CAPTURE_MAGIC 0x50434753
+#define TOUCH_CAPTURE_VERSION 1
+
+typedef struct {
+    /// TOUCH_CAPTURE_MAGIC
+    uint32_t magic;
+    /// TOUCH_CAPTURE_VERSION
+    uint32_t version;
+} TouchCaptureHeader;
+
+typedef struct {
+    /// ns since the recording started
+    uint64_t time;
+    /// number of stream bytes following this chunk; the next chunk starts at the next multiple of 8
+    uint32_t size;
+    uint32_t reserved;
+} TouchCaptureChunk;
+
+/**
+ * @param size the size of the chunk's data
+ * @return the number of bytes from the start of a chunk to the start of the next one
+ */
+static inline uint64_t getTouchCaptureChunkSpan(uint32_t size) {
+    return sizeof(TouchCaptureChunk) + (((uint64_t)size + 7) & ~7ULL);
+}
+#endif
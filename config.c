@@ -0,0 +1,73 @@
+#include "event.h"
+#include "ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/// Reorder window in ms used when reading several writers
+#define MERGE_WINDOW 20
+
+/**
+ * Reads every colon separated fifo in sources and processes their records in time order
+ *
+ * @return 0 once every fifo is closed or 1 if one couldn't be opened or read
+ */
+static int readTouchEventSources(char* sources) {
+    uint32_t maxSources = 1;
+    for(const char* c = sources; *c; c++)
+        maxSources += *c == ':';
+    int* fds = malloc(sizeof(int) * maxSources);
+    TouchEventMerger* merger = createTouchEventMerger(MERGE_WINDOW);
+    uint32_t numFds = 0;
+    TouchReadStatus status = TOUCH_READ_ERROR;
+    if(!fds || !merger)
+        goto cleanup;
+    for(char* path = strtok(sources, ":"); path; path = strtok(NULL, ":")) {
+        // opened for writing too so a fifo doesn't report EOF while its writer restarts
+        int fd = open(path, O_RDWR | O_NONBLOCK);
+        if(fd == -1) {
+            perror(path);
+            goto cleanup;
+        }
+        fds[numFds++] = fd;
+        if(addTouchEventSource(merger, fd) == -1) {
+            perror(path);
+            goto cleanup;
+        }
+    }
+    while((status = processTouchEventMerger(merger, -1)) == TOUCH_READ_AGAIN);
+    if(status != TOUCH_READ_EOF)
+        fprintf(stderr, "Failed to read sources: %s\n", status == TOUCH_READ_MALFORMED ? "malformed stream" : strerror(errno));
+cleanup:
+    if(merger)
+        freeTouchEventMerger(merger);
+    while(numFds)
+        close(fds[--numFds]);
+    free(fds);
+    return status != TOUCH_READ_EOF;
+}
+
+int main(int argc, char* const argv[]) {
+    GestureMask mask = argc > 1 ?  atoi(argv[1]) : GestureEndMask;
+    listenForGestureEvents(mask);
+    dumpGestureStatsOnSignal(SIGUSR1, STDERR_FILENO);
+    const char* ringPath = getenv("SGESTURES_RING");
+    if(ringPath) {
+        TouchRingReader* reader = attachTouchRing(ringPath);
+        if(!reader)
+            return 1;
+        while(readTouchRing(reader) > 0);
+        detachTouchRing(reader);
+        return 0;
+    }
+    char* sources = getenv("SGESTURES_SOURCES");
+    if(sources)
+        return readTouchEventSources(sources);
+    while(readTouchEvents(STDIN_FILENO) > 0);
+    return 0;
+}
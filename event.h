@@ -31,6 +31,15 @@ typedef struct {
     /// The last point of the gesture
     GesturePoint endPoint;
     GesturePoint endPercentPoint;
+
+    /// @{ Only set for GestureMotionMask and GestureEndMask events
+    /// spread of the group's fingers about their centroid relative to their spread when they started
+    double scale;
+    /// radians the group's fingers have turned about their centroid since they started, from the x towards the y axis
+    double rotation;
+    /// average of the last point of every finger of the group
+    GesturePoint centroid;
+    /// @}
 } GestureEvent ;
 /**
  * Gesture specific bindings
@@ -47,9 +56,199 @@ typedef struct {
 bool matchesGestureEvent(GestureBindingArg* binding, const GestureEvent* event);
 bool matchesGestureFlags(GestureBindingArg* binding, const GestureFlags* flags);
 
+/**
+ * Index over an array of bindings. Bindings are bucketed by mask, reflectionMask,
+ * detail, exact finger count and region/device id so finding the bindings that
+ * match an event doesn't require checking every binding
+ */
+typedef struct GestureBindingRegistry GestureBindingRegistry;
+/**
+ * Builds an index over num bindings. The bindings aren't copied and must
+ * outlive the registry and not be modified.
+ * Bindings are typically a member of a larger struct:
+ * ex: createGestureBindingRegistry(&bindings[0].arg, LEN(bindings), sizeof(bindings[0]))
+ *
+ * @param bindings the first binding
+ * @param num number of bindings
+ * @param stride number of bytes between consecutive bindings
+ *
+ * @return a new registry
+ */
+GestureBindingRegistry* createGestureBindingRegistry(const GestureBindingArg* bindings, uint32_t num, size_t stride);
+/**
+ * Finds the bindings that match event; equivalent to calling matchesGestureEvent on every binding
+ *
+ * @param registry
+ * @param event
+ * @param matches filled with the indices of matching bindings in ascending order
+ * @param maxMatches size of matches
+ *
+ * @return the number of indices written to matches
+ */
+uint32_t findGestureBindings(const GestureBindingRegistry* registry, const GestureEvent* event, uint32_t* matches, uint32_t maxMatches);
+void freeGestureBindingRegistry(GestureBindingRegistry* registry);
+
+/// Trie node reached by a detail that isn't the prefix of any binding's detail
+#define NO_GESTURE_PREFIX ((uint32_t)-1)
+/**
+ * The details of a registry's bindings form a prefix trie whose root is node 0.
+ * Bindings without a detail don't take part.
+ *
+ * @param registry
+ * @param node the node reached so far
+ * @param type the next type of the detail
+ *
+ * @return the node reached after type or NO_GESTURE_PREFIX
+ */
+uint32_t advanceGesturePrefix(const GestureBindingRegistry* registry, uint32_t node, GestureType type);
+/**
+ * @param registry
+ * @param node
+ *
+ * @return the first binding with the only detail that starts with node's prefix or NULL if there isn't exactly one such detail
+ */
+const GestureBindingArg* getGesturePrefixMatch(const GestureBindingRegistry* registry, uint32_t node);
+/**
+ * Tracks the types of every touch through registry's prefix trie. Once only one
+ * binding detail can match a touch a GestureMatchMask event with that detail is
+ * generated, and once none can a GestureNoMatchMask event is. Either is
+ * generated at most once per touch.
+ *
+ * @param registry the bindings to track or NULL to stop
+ */
+void listenForGesturePrefixes(const GestureBindingRegistry* registry);
+void listenForGesturePrefixesInContext(GestureContext* context, const GestureBindingRegistry* registry);
+
 void dumpGesture(GestureEvent* event);
+/**
+ * Dumps event and then releases it
+ * @see releaseGestureEvent
+ */
 void dumpAndFreeGesture(GestureEvent* event);
 
+/**
+ * Returns an unused GestureEvent, recycling a previously released one if possible.
+ * Every event given to an event handler is obtained this way.
+ *
+ * @return a GestureEvent with undefined contents
+ */
+GestureEvent* borrowGestureEvent();
+/**
+ * Gives event back to be reused by later events. Once the handler is done with
+ * an event it should release it; calling free() is still allowed but means
+ * the next event will have to be allocated. Events with a reflectionMask are
+ * delivered alongside their reflection, which shares their allocation, so
+ * they must always be released
+ *
+ * @param event an event obtained from borrowGestureEvent
+ */
+void releaseGestureEvent(GestureEvent* event);
 
+/**
+ * Sets the function to be called for every generated GestureEvent. The handler
+ * takes ownership of the event and is responsible for releasing it
+ *
+ * @param handler the new handler or NULL to restore the default
+ */
 void registerEventHandler(void (*handler)(GestureEvent* event));
+void registerEventHandlerInContext(GestureContext* context, void (*handler)(GestureEvent* event));
+
+/// Counters describing events handed to the handler thread
+typedef struct {
+    /// events added to the queue
+    uint64_t queued;
+    /// TouchMotionMask and TouchHoldMask events discarded because the queue was full
+    uint64_t dropped;
+    /// other events that had to wait for the handler to make room
+    uint64_t stalled;
+    /// queued events that were skipped because a newer one replaced them
+    uint64_t merged;
+} EventQueueStats;
+
+/**
+ * Runs the event handler on a dedicated thread. Events are passed to it through
+ * a bounded lock-free queue so a slow handler doesn't stall touch processing.
+ * When the queue is full, TouchMotionMask and TouchHoldMask events are dropped
+ * and every other event waits until the handler catches up.
+ * The handler must not be changed while the thread is running.
+ * Only events of the default context are passed to the thread; other contexts
+ * always call their handler synchronously.
+ *
+ * @return 0 or -1 if the thread couldn't be started
+ */
+int startEventHandlerThread();
+/**
+ * Waits for the handler thread to handle all queued events and stops it.
+ * Subsequent events are handled synchronously again
+ */
+void stopEventHandlerThread();
+/**
+ * @return counters describing the handler thread's queue since the program started
+ */
+EventQueueStats getEventQueueStats();
+/**
+ * When enabled, a TouchMotionMask or TouchHoldMask event still waiting for the
+ * handler thread is skipped once a newer one of the same touch is queued, so
+ * the handler only sees the latest state of a touch when it falls behind.
+ * An event is never skipped in favor of one queued after any other event of
+ * its touch, so no other event is dropped or reordered.
+ * GestureMotionMask events are likewise skipped once a newer one of the same
+ * group is queued unless a touch of the group started or stopped in between.
+ * Has no effect unless the handler thread is running.
+ *
+ * @param coalesce
+ */
+void coalesceMotionEvents(bool coalesce);
+
+/// Number of buckets of each histogram of GestureStats
+#define GESTURE_STATS_BUCKETS 32
+/// Max number of devices whose events are counted separately
+#define MAX_GESTURE_STATS_DEVICES 32
+/**
+ * Counters of the events given to the handler since the program started.
+ * Bucket i of a histogram counts values in [2^(i-1), 2^i); bucket 0 counts 0
+ * and the last bucket also counts every larger value
+ */
+typedef struct {
+    /// handled events by the index of the bit of their mask
+    uint64_t events[sizeof(GestureMask) * 8];
+    /// handled events by device
+    struct {
+        uint64_t id;
+        uint64_t events;
+    } devices[MAX_GESTURE_STATS_DEVICES];
+    /// handled events of devices that didn't fit in devices
+    uint64_t otherDevices;
+    /// generated events released without being handled because nothing listened for them
+    uint64_t unselected;
+    /// events dropped or merged by the handler thread's queue
+    uint64_t dropped;
+    /// events that couldn't be recycled and had to be allocated
+    uint64_t allocations;
+    /// ms from the time of an event to the handler returning; assumes event times are CLOCK_MONOTONIC ms like libinput's
+    uint64_t latency[GESTURE_STATS_BUCKETS];
+    /// ns spent in the handler per event
+    uint64_t handlerTime[GESTURE_STATS_BUCKETS];
+} GestureStats;
+
+/**
+ * @return a snapshot of the counters; each counter is read atomically but not all at once
+ */
+GestureStats getGestureStats();
+/**
+ * Writes the non-zero counters to fd as "name value" lines.
+ * Async-signal-safe
+ *
+ * @param fd
+ */
+void dumpGestureStats(int fd);
+/**
+ * Installs a handler that calls dumpGestureStats whenever sig is received
+ *
+ * @param sig ex: SIGUSR1
+ * @param fd where to dump the counters
+ *
+ * @return the return value of sigaction
+ */
+int dumpGestureStatsOnSignal(int sig, int fd);
 #endif
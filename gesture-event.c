@@ -1,14 +1,19 @@
-#define _POSIX_C_SOURCE  199309L
+#define _POSIX_C_SOURCE  200809L
 
 #include <assert.h>
 #include <errno.h>
 #include <linux/input.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
 #include "gestures.h"
+#include "gestures-private.h"
 #include "event.h"
 
 #define GESTURE_MERGE_DELAY_TIME 200
@@ -18,62 +23,333 @@
  * This class is intended to have a 1 read thread and one thread write.
  * Multiple threads trying to read or trying to write will cause problems
  *
+ * The indices only ever increase and are kept on separate cache lines so the
+ * reader and writer don't contend for the same line
  */
 typedef struct RingBuffer {
     GestureEvent* eventBuffer[MAX_BUFFER_SIZE];
-    /// next index to read from
-    uint16_t bufferIndexRead;
-    /// next index to write to
-    uint16_t bufferIndexWrite;
+    /// next index to read from; only modified by the reader
+    uint32_t bufferIndexRead __attribute__((aligned(64)));
+    /// next index to write to; only modified by the writer
+    uint32_t bufferIndexWrite __attribute__((aligned(64)));
 } RingBuffer;
 static inline uint32_t getBufferSize(RingBuffer* buffer) {
-    if(buffer->bufferIndexWrite >= buffer->bufferIndexRead)
-        return buffer->bufferIndexWrite - buffer->bufferIndexRead;
-    return buffer->bufferIndexWrite + (MAX_BUFFER_SIZE - buffer->bufferIndexRead);
+    return __atomic_load_n(&buffer->bufferIndexWrite, __ATOMIC_ACQUIRE) - __atomic_load_n(&buffer->bufferIndexRead, __ATOMIC_ACQUIRE);
 }
 static inline bool isBufferFull(RingBuffer* buffer) {return getBufferSize(buffer) == MAX_BUFFER_SIZE ;}
-static inline GestureEvent* bufferPeek(RingBuffer* buffer) {return buffer->eventBuffer[buffer->bufferIndexRead % MAX_BUFFER_SIZE];}
+/**
+ * @return 1 iff event was added; 0 if the buffer was full
+ */
 static inline bool bufferPush(RingBuffer* buffer, GestureEvent* event) {
-    if(!isBufferFull(buffer) && event) {
-        buffer->eventBuffer[buffer->bufferIndexWrite++ % MAX_BUFFER_SIZE] = event;
-    }
-    return event && !isBufferFull(buffer);
+    if(isBufferFull(buffer))
+        return 0;
+    buffer->eventBuffer[buffer->bufferIndexWrite % MAX_BUFFER_SIZE] = event;
+    __atomic_store_n(&buffer->bufferIndexWrite, buffer->bufferIndexWrite + 1, __ATOMIC_RELEASE);
+    return 1;
 }
+/**
+ * @return the oldest event or NULL if the buffer is empty
+ */
 static inline GestureEvent* bufferPop(RingBuffer* buffer) {
-    return buffer->eventBuffer[buffer->bufferIndexRead++ % MAX_BUFFER_SIZE];
+    if(!getBufferSize(buffer))
+        return NULL;
+    GestureEvent* event = buffer->eventBuffer[buffer->bufferIndexRead % MAX_BUFFER_SIZE];
+    __atomic_store_n(&buffer->bufferIndexRead, buffer->bufferIndexRead + 1, __ATOMIC_RELEASE);
+    return event;
 }
 
+/**
+ * A borrowed event and the slot of its reflection. The reflection shares the
+ * event's allocation so reflecting an event never borrows or allocates; the
+ * block is only reused once every event of it has been released. event comes
+ * first so an event without a reflection can still be handed to free()
+ */
+typedef struct {
+    GestureEvent event;
+    GestureEvent reflection;
+    /// number of events of the block not yet released
+    uint32_t refs;
+} GestureEventBlock;
+/// Blocks are aligned to this so the block of either of its events can be found from the event's address
+#define GESTURE_EVENT_BLOCK_ALIGN 1024
+_Static_assert(sizeof(GestureEventBlock) <= GESTURE_EVENT_BLOCK_ALIGN, "GestureEventBlock must fit in its alignment");
+
+static inline GestureEventBlock* getGestureEventBlock(GestureEvent* event) {
+    return (GestureEventBlock*)((uintptr_t)event & ~(uintptr_t)(GESTURE_EVENT_BLOCK_ALIGN - 1));
+}
 
+/// Max number of released GestureEventBlocks kept around for reuse
+#define MAX_EVENT_POOL_SIZE 64
+/// Stack of blocks whose events have all been released
+static struct {
+    GestureEventBlock* blocks[MAX_EVENT_POOL_SIZE];
+    uint32_t size;
+    /// events are released by the handler thread when one is running
+    pthread_mutex_t lock;
+} eventPool = {.lock = PTHREAD_MUTEX_INITIALIZER};
 
-static uint32_t gestureSelectMask = -1;
+GestureEvent* borrowGestureEvent() {
+    GestureEventBlock* block = NULL;
+    pthread_mutex_lock(&eventPool.lock);
+    if(eventPool.size)
+        block = eventPool.blocks[--eventPool.size];
+    pthread_mutex_unlock(&eventPool.lock);
+    if(!block) {
+        recordGestureEventAllocation();
+        if(posix_memalign((void**)&block, GESTURE_EVENT_BLOCK_ALIGN, sizeof(GestureEventBlock)))
+            return NULL;
+    }
+    block->refs = 1;
+    return &block->event;
+}
+
+void releaseGestureEvent(GestureEvent* event) {
+    GestureEventBlock* block = getGestureEventBlock(event);
+    if(__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+    pthread_mutex_lock(&eventPool.lock);
+    if(eventPool.size < MAX_EVENT_POOL_SIZE) {
+        eventPool.blocks[eventPool.size++] = block;
+        block = NULL;
+    }
+    pthread_mutex_unlock(&eventPool.lock);
+    free(block);
+}
+
+void listenForGestureEventsInContext(GestureContext* context, uint32_t mask) {
+    context->selectMask = mask;
+}
 void listenForGestureEvents(uint32_t mask) {
-    gestureSelectMask = mask;
+    listenForGestureEventsInContext(getGestureContext(), mask);
+}
+void computeDerivedFieldsInContext(GestureContext* context, uint32_t mask) {
+    context->derivedMask = mask;
+}
+void computeDerivedFields(uint32_t mask) {
+    computeDerivedFieldsInContext(getGestureContext(), mask);
+}
+/**
+ * @return true if events with the given mask would be passed to the handler
+ */
+bool isGestureEventSelected(GestureMask mask) {
+    return mask & getGestureContext()->selectMask;
+}
+void registerEventHandlerInContext(GestureContext* context, void (*handler)(GestureEvent* event)) {
+    context->handler = handler ? handler : dumpAndFreeGesture;
 }
-static void (*gestureEventHandler)(GestureEvent* event) = dumpAndFreeGesture;
 void registerEventHandler(void (*handler)(GestureEvent* event)) {
-    gestureEventHandler = handler ? handler : dumpAndFreeGesture;
+    registerEventHandlerInContext(getGestureContext(), handler);
+}
+
+/**
+ * Passes event to the handler and records how long it took.
+ * The handler owns event so everything recorded is read beforehand
+ */
+static void handleEvent(GestureEvent* event) {
+    GestureMask mask = event->flags.mask;
+    ProductID device = GESTURE_DEVICE_ID(event);
+    uint32_t time = event->time;
+    uint64_t start = getMonotonicTimeNs();
+    getGestureContext()->handler(event);
+    recordHandledGestureEvent(mask, device, time, start, getMonotonicTimeNs());
+}
+
+/// Events waiting for the handler thread
+static RingBuffer eventQueue;
+static struct {
+    pthread_t thread;
+    /// posted once per queued event and once more to stop
+    sem_t pending;
+    volatile bool running;
+    EventQueueStats stats;
+} handlerThread;
+
+/// Number of touches and of groups whose last queued motion event is remembered at once
+#define MAX_COALESCED_TOUCHES 256
+/// Queue index of the last motion event of a touch or group
+typedef struct {
+    uint64_t id;
+    uint32_t index;
+    bool valid;
+} LastMotion;
+static struct {
+    bool enabled;
+    /// set to 1 + the queue index of a motion event once a newer one for the same touch has been queued
+    uint32_t superseded[MAX_BUFFER_SIZE];
+    /// only used by the thread generating events
+    /// @{
+    LastMotion lastMotion[MAX_COALESCED_TOUCHES];
+    LastMotion lastGroupMotion[MAX_COALESCED_TOUCHES];
+    /// @}
+} coalescing;
+
+void coalesceMotionEvents(bool coalesce) {
+    coalescing.enabled = coalesce;
+}
+
+static inline LastMotion* getLastMotion(LastMotion* table, uint64_t id) {
+    return &table[(id ^ id >> 32) * 0x9E3779B1u % MAX_COALESCED_TOUCHES];
+}
+
+/**
+ * Marks the last motion event of id superseded by the one queued at index
+ */
+static void supersedeLastMotion(LastMotion* table, uint64_t id, uint32_t index) {
+    LastMotion* last = getLastMotion(table, id);
+    if(last->valid && last->id == id)
+        __atomic_store_n(&coalescing.superseded[last->index % MAX_BUFFER_SIZE], last->index + 1, __ATOMIC_RELEASE);
+    *last = (LastMotion) {id, index, 1};
+}
+
+static void forgetLastMotion(LastMotion* table, uint64_t id) {
+    LastMotion* last = getLastMotion(table, id);
+    if(last->valid && last->id == id)
+        last->valid = 0;
+}
+
+/**
+ * Records that event was added to the queue at index. If event is a motion or
+ * hold event, the previous such event of the same touch is marked superseded
+ * unless an other event of that touch was queued in between. Group motion
+ * events likewise supersede the previous one of their group unless a touch of
+ * the group started or stopped in between
+ */
+static void updateCoalescing(const GestureEvent* event, uint32_t index) {
+    if(event->flags.mask & GestureMotionMask)
+        supersedeLastMotion(coalescing.lastGroupMotion, event->id, index);
+    else if(event->flags.mask & (TouchMotionMask | TouchHoldMask))
+        supersedeLastMotion(coalescing.lastMotion, event->lastEventId, index);
+    else {
+        forgetLastMotion(coalescing.lastMotion, event->lastEventId);
+        forgetLastMotion(coalescing.lastGroupMotion, event->id);
+    }
+}
+
+static void* handleQueuedEvents(void* arg __attribute__((unused))) {
+    while(1) {
+        while(sem_wait(&handlerThread.pending) == -1 && errno == EINTR);
+        uint32_t index = eventQueue.bufferIndexRead;
+        GestureEvent* event = bufferPop(&eventQueue);
+        if(!event)
+            break;
+        if(__atomic_load_n(&coalescing.superseded[index % MAX_BUFFER_SIZE], __ATOMIC_ACQUIRE) == index + 1) {
+            __atomic_add_fetch(&handlerThread.stats.merged, 1, __ATOMIC_RELAXED);
+            recordDroppedGestureEvent();
+            releaseGestureEvent(event);
+            continue;
+        }
+        handleEvent(event);
+    }
+    return NULL;
+}
+
+int startEventHandlerThread() {
+    if(handlerThread.running)
+        return 0;
+    if(sem_init(&handlerThread.pending, 0, 0) == -1)
+        return -1;
+    if(pthread_create(&handlerThread.thread, NULL, handleQueuedEvents, NULL)) {
+        sem_destroy(&handlerThread.pending);
+        return -1;
+    }
+    handlerThread.running = 1;
+    return 0;
+}
+
+void stopEventHandlerThread() {
+    if(!handlerThread.running)
+        return;
+    handlerThread.running = 0;
+    // the thread handles everything still queued before seeing the empty queue
+    sem_post(&handlerThread.pending);
+    pthread_join(handlerThread.thread, NULL);
+    sem_destroy(&handlerThread.pending);
+}
+
+EventQueueStats getEventQueueStats() {
+    EventQueueStats stats;
+    stats.queued = __atomic_load_n(&handlerThread.stats.queued, __ATOMIC_RELAXED);
+    stats.dropped = __atomic_load_n(&handlerThread.stats.dropped, __ATOMIC_RELAXED);
+    stats.stalled = __atomic_load_n(&handlerThread.stats.stalled, __ATOMIC_RELAXED);
+    stats.merged = __atomic_load_n(&handlerThread.stats.merged, __ATOMIC_RELAXED);
+    return stats;
+}
+
+/**
+ * Hands event to the handler thread.
+ * If the queue is full motion, hold and group motion events are dropped; all other events wait for room
+ */
+static void queueEvent(GestureEvent* event) {
+    uint32_t index = eventQueue.bufferIndexWrite;
+    if(!bufferPush(&eventQueue, event)) {
+        if(event->flags.mask & (TouchMotionMask | TouchHoldMask | GestureMotionMask)) {
+            __atomic_add_fetch(&handlerThread.stats.dropped, 1, __ATOMIC_RELAXED);
+            recordDroppedGestureEvent();
+            releaseGestureEvent(event);
+            return;
+        }
+        __atomic_add_fetch(&handlerThread.stats.stalled, 1, __ATOMIC_RELAXED);
+        while(!bufferPush(&eventQueue, event))
+            sched_yield();
+    }
+    if(coalescing.enabled)
+        updateCoalescing(event, index);
+    __atomic_add_fetch(&handlerThread.stats.queued, 1, __ATOMIC_RELAXED);
+    sem_post(&handlerThread.pending);
+}
+
+/// Serializes queueEvent when events are generated by multiple threads
+static struct {
+    bool enabled;
+    pthread_mutex_t lock;
+} producers = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+void setMultipleEventProducers(bool multiple) {
+    producers.enabled = multiple;
+}
+
+static inline void dispatchEvent(GestureEvent* event) {
+    // the handler thread calls the default context's handler
+    if(!handlerThread.running || getGestureContext() != getDefaultGestureContext())
+        handleEvent(event);
+    else if(producers.enabled) {
+        pthread_mutex_lock(&producers.lock);
+        queueEvent(event);
+        pthread_mutex_unlock(&producers.lock);
+    }
+    else
+        queueEvent(event);
 }
 
 void enqueueEvent(GestureEvent* event) {
     assert(event);
-    if (event->flags.mask & gestureSelectMask) {
+    if (isGestureEventSelected(event->flags.mask)) {
         GestureEvent* reflectionEvent = NULL;
         if (event->flags.reflectionMask) {
-            reflectionEvent = malloc(sizeof(GestureEvent));
-            memcpy(reflectionEvent, event, sizeof(GestureEvent));
-            if(reflectionEvent->flags.reflectionMask == Rotate90Mask)
-                reflectionEvent->flags.reflectionMask = Rotate270Mask;
-            else if(reflectionEvent->flags.reflectionMask == Rotate270Mask)
-                reflectionEvent->flags.reflectionMask = Rotate90Mask;
-            transformGestureDetail(reflectionEvent->detail, reflectionEvent->flags.reflectionMask);
+            TransformMasks mask = event->flags.reflectionMask;
+            if(mask == Rotate90Mask)
+                mask = Rotate270Mask;
+            else if(mask == Rotate270Mask)
+                mask = Rotate90Mask;
+            // the reflection lives in event's block and holds a reference to it
+            GestureEventBlock* block = getGestureEventBlock(event);
+            assert(event == &block->event);
+            __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+            reflectionEvent = &block->reflection;
+            // everything but the detail is copied as is; the detail is transformed while copying
+            memcpy(reflectionEvent, event, offsetof(GestureEvent, detail));
+            copyTransformedGestureDetail(&reflectionEvent->detail, &event->detail, mask);
+            memcpy(&reflectionEvent->flags, &event->flags, sizeof(GestureEvent) - offsetof(GestureEvent, flags));
+            reflectionEvent->flags.reflectionMask = mask;
         }
-        gestureEventHandler(event);
+        dispatchEvent(event);
         if (reflectionEvent) {
-            gestureEventHandler(reflectionEvent);
+            dispatchEvent(reflectionEvent);
         }
     }
     else {
-        free(event);
+        recordUnselectedGestureEvent();
+        releaseGestureEvent(event);
     }
 }
 
@@ -120,5 +396,5 @@ void dumpGesture(GestureEvent* event) {
 
 void dumpAndFreeGesture(GestureEvent* event) {
     dumpGesture(event);
-    free(event);
+    releaseGestureEvent(event);
 }
@@ -0,0 +1,263 @@
+/**
+ * @file
+ *
+ * Index over GestureBindingArgs so that matching an event only has to
+ * consider bindings that could possibly match it.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "event.h"
+#include "gestures-private.h"
+
+/**
+ * The exactly matched properties of a binding. A property the binding
+ * doesn't restrict to a single value is left 0 so that binding is found with
+ * the wildcard key
+ */
+typedef struct {
+    uint32_t detailHash;
+    /// a region or device id depending on idType
+    uint32_t id;
+    uint32_t fingers;
+    /// index of a bit of the binding's mask
+    uint8_t maskBit;
+    uint8_t reflectionMask;
+    /// 1 if the binding has a non-empty detail
+    uint8_t hasDetail;
+    /// 0 if id isn't used, otherwise one of RegionIDKey or DeviceIDKey
+    uint8_t idType;
+} BindingKey;
+enum {RegionIDKey = 1, DeviceIDKey = 2};
+
+typedef struct {
+    BindingKey key;
+    /// offset of this bucket's binding indices in GestureBindingRegistry.indices
+    uint32_t start;
+    /// number of indices; 0 for an empty slot
+    uint32_t size;
+} BindingBucket;
+
+/// Node of the trie formed by the details of all bindings
+typedef struct {
+    /// index of the node reached by each type; 0 if there isn't one
+    uint32_t children[1 << 4];
+    /// number of distinct details that start with this node's prefix
+    uint32_t numDetails;
+    /// the first binding with the first detail that was added under this node
+    uint32_t binding;
+    /// true if this prefix is a complete detail
+    bool terminal;
+} PrefixNode;
+
+struct GestureBindingRegistry {
+    const char* bindings;
+    size_t stride;
+    /// binding indices grouped by bucket; ascending within each bucket
+    uint32_t* indices;
+    /// open addressed table of buckets
+    BindingBucket* buckets;
+    uint32_t capacity;
+    /// prefix trie; the first node is the root
+    PrefixNode* prefixNodes;
+    uint32_t numPrefixNodes;
+};
+
+typedef struct {
+    BindingKey key;
+    uint32_t index;
+} BindingEntry;
+
+static inline bool areKeysEqual(const BindingKey* a, const BindingKey* b) {
+    return a->detailHash == b->detailHash && a->id == b->id && a->fingers == b->fingers && a->maskBit == b->maskBit &&
+        a->reflectionMask == b->reflectionMask && a->hasDetail == b->hasDetail && a->idType == b->idType;
+}
+
+static inline uint32_t hashKey(const BindingKey* key) {
+    uint64_t h = ((uint64_t)key->detailHash << 32 | key->id) ^ ((uint64_t)key->fingers << 32 | key->maskBit << 24 |
+            key->reflectionMask << 16 | key->hasDetail << 8 | key->idType) * 0x9E3779B97F4A7C15L;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int compareEntries(const void* a, const void* b) {
+    const BindingEntry* e1 = a, *e2 = b;
+    int cmp = memcmp(&e1->key, &e2->key, sizeof(BindingKey));
+    return cmp ? cmp : (e1->index > e2->index) - (e1->index < e2->index);
+}
+
+static inline GestureBindingArg* getBinding(const GestureBindingRegistry* registry, uint32_t i) {
+    return (GestureBindingArg*)(registry->bindings + i * registry->stride);
+}
+
+static const BindingBucket* findBucket(const GestureBindingRegistry* registry, const BindingKey* key) {
+    uint32_t i = hashKey(key) & (registry->capacity - 1);
+    while(registry->buckets[i].size) {
+        if(areKeysEqual(&registry->buckets[i].key, key))
+            return &registry->buckets[i];
+        i = (i + 1) & (registry->capacity - 1);
+    }
+    return NULL;
+}
+
+/**
+ * @return the key binding is stored under except for maskBit
+ */
+static BindingKey getBindingKey(const GestureBindingArg* binding) {
+    BindingKey key = {.reflectionMask = binding->minFlags.reflectionMask};
+    if(getNumOfTypes(binding->detail)) {
+        key.hasDetail = 1;
+        key.detailHash = binding->detail.hash;
+    }
+    if(binding->minFlags.fingers && (!binding->maxFlags.fingers || binding->maxFlags.fingers == binding->minFlags.fingers))
+        key.fingers = binding->minFlags.fingers;
+    if(binding->regionID) {
+        key.idType = RegionIDKey;
+        key.id = binding->regionID;
+    } else if(binding->deviceID) {
+        key.idType = DeviceIDKey;
+        key.id = binding->deviceID;
+    }
+    return key;
+}
+
+/**
+ * Adds the detail of the i-th binding to registry's prefix trie
+ */
+static void addPrefix(GestureBindingRegistry* registry, const GestureDetail* detail, uint32_t i, uint32_t* prefixCapacity) {
+    uint32_t path[MAX_GESTURE_DETAIL_SIZE + 1] = {0};
+    for(int n = 0; n < getNumOfTypes(*detail); n++) {
+        uint32_t* child = &registry->prefixNodes[path[n]].children[getGestureType(*detail, n)];
+        if(!*child) {
+            if(registry->numPrefixNodes == *prefixCapacity) {
+                *prefixCapacity *= 2;
+                registry->prefixNodes = realloc(registry->prefixNodes, sizeof(PrefixNode) * *prefixCapacity);
+                child = &registry->prefixNodes[path[n]].children[getGestureType(*detail, n)];
+            }
+            memset(&registry->prefixNodes[registry->numPrefixNodes], 0, sizeof(PrefixNode));
+            *child = registry->numPrefixNodes++;
+        }
+        path[n + 1] = *child;
+    }
+    PrefixNode* last = &registry->prefixNodes[path[getNumOfTypes(*detail)]];
+    if(last->terminal)
+        return;
+    last->terminal = true;
+    for(int n = 0; n <= getNumOfTypes(*detail); n++)
+        if(registry->prefixNodes[path[n]].numDetails++ == 0)
+            registry->prefixNodes[path[n]].binding = i;
+}
+
+uint32_t advanceGesturePrefix(const GestureBindingRegistry* registry, uint32_t node, GestureType type) {
+    if(node == NO_GESTURE_PREFIX)
+        return NO_GESTURE_PREFIX;
+    uint32_t child = registry->prefixNodes[node].children[type & 0xF];
+    return child ? child : NO_GESTURE_PREFIX;
+}
+
+const GestureBindingArg* getGesturePrefixMatch(const GestureBindingRegistry* registry, uint32_t node) {
+    if(node == NO_GESTURE_PREFIX || registry->prefixNodes[node].numDetails != 1)
+        return NULL;
+    return getBinding(registry, registry->prefixNodes[node].binding);
+}
+
+GestureBindingRegistry* createGestureBindingRegistry(const GestureBindingArg* bindings, uint32_t num, size_t stride) {
+    const uint32_t maskBits = sizeof(GestureMask) * 8;
+    BindingEntry* entries = malloc(sizeof(BindingEntry) * (num * maskBits + 1));
+    uint32_t numEntries = 0;
+    for(uint32_t i = 0; i < num; i++) {
+        const GestureBindingArg* binding = (const GestureBindingArg*)((const char*)bindings + i * stride);
+        BindingKey key = getBindingKey(binding);
+        GestureMask mask = binding->minFlags.mask ? binding->minFlags.mask : GestureEndMask;
+        for(uint32_t bit = 0; bit < maskBits; bit++)
+            if(mask & 1 << bit) {
+                memset(&entries[numEntries], 0, sizeof(BindingEntry));
+                entries[numEntries].key = key;
+                entries[numEntries].key.maskBit = bit;
+                entries[numEntries++].index = i;
+            }
+    }
+    qsort(entries, numEntries, sizeof(BindingEntry), compareEntries);
+
+    GestureBindingRegistry* registry = malloc(sizeof(GestureBindingRegistry));
+    registry->bindings = (const char*)bindings;
+    registry->stride = stride;
+    registry->indices = malloc(sizeof(uint32_t) * (numEntries + 1));
+    registry->capacity = 16;
+    while(registry->capacity < numEntries * 2)
+        registry->capacity *= 2;
+    registry->buckets = calloc(registry->capacity, sizeof(BindingBucket));
+    for(uint32_t i = 0; i < numEntries; i++) {
+        registry->indices[i] = entries[i].index;
+        if(i && areKeysEqual(&entries[i - 1].key, &entries[i].key))
+            continue;
+        uint32_t slot = hashKey(&entries[i].key) & (registry->capacity - 1);
+        while(registry->buckets[slot].size)
+            slot = (slot + 1) & (registry->capacity - 1);
+        uint32_t end = i + 1;
+        while(end < numEntries && areKeysEqual(&entries[i].key, &entries[end].key))
+            end++;
+        registry->buckets[slot] = (BindingBucket) {entries[i].key, i, end - i};
+    }
+    free(entries);
+    uint32_t prefixCapacity = 16;
+    registry->prefixNodes = calloc(prefixCapacity, sizeof(PrefixNode));
+    registry->numPrefixNodes = 1;
+    for(uint32_t i = 0; i < num; i++)
+        if(getNumOfTypes(getBinding(registry, i)->detail))
+            addPrefix(registry, &getBinding(registry, i)->detail, i, &prefixCapacity);
+    return registry;
+}
+
+void freeGestureBindingRegistry(GestureBindingRegistry* registry) {
+    free(registry->indices);
+    free(registry->buckets);
+    free(registry->prefixNodes);
+    free(registry);
+}
+
+/**
+ * Inserts index into the sorted list matches, keeping only the smallest maxMatches indices
+ */
+static inline uint32_t insertMatch(uint32_t* matches, uint32_t numMatches, uint32_t maxMatches, uint32_t index) {
+    if(numMatches == maxMatches && (!maxMatches || matches[numMatches - 1] < index))
+        return numMatches;
+    uint32_t i = numMatches < maxMatches ? numMatches++ : numMatches - 1;
+    for(; i && matches[i - 1] > index; i--)
+        matches[i] = matches[i - 1];
+    matches[i] = index;
+    return numMatches;
+}
+
+uint32_t findGestureBindings(const GestureBindingRegistry* registry, const GestureEvent* event, uint32_t* matches, uint32_t maxMatches) {
+    if(!event->flags.mask)
+        return 0;
+    // every bit of the event's mask must be in a matching binding's mask so only one needs to be checked
+    uint8_t maskBit = __builtin_ctz(event->flags.mask);
+    uint32_t ids[] = {0, GESTURE_REGION_ID(event), GESTURE_DEVICE_ID(event)};
+    uint32_t numMatches = 0;
+    for(int hasDetail = 0; hasDetail < 2; hasDetail++)
+        for(int exactFingers = 0; exactFingers < 2; exactFingers++)
+            for(uint8_t idType = 0; idType < LEN(ids); idType++) {
+                if(exactFingers && !event->flags.fingers || idType && !ids[idType])
+                    continue;
+                BindingKey key = {
+                    .detailHash = hasDetail ? event->detail.hash : 0,
+                    .id = ids[idType],
+                    .fingers = exactFingers ? event->flags.fingers : 0,
+                    .maskBit = maskBit,
+                    .reflectionMask = event->flags.reflectionMask,
+                    .hasDetail = hasDetail,
+                    .idType = idType,
+                };
+                const BindingBucket* bucket = findBucket(registry, &key);
+                if(!bucket)
+                    continue;
+                for(uint32_t i = bucket->start; i < bucket->start + bucket->size; i++)
+                    if(matchesGestureEvent(getBinding(registry, registry->indices[i]), event))
+                        numMatches = insertMatch(matches, numMatches, maxMatches, registry->indices[i]);
+            }
+    return numMatches;
+}
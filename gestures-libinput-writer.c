@@ -2,6 +2,7 @@
  * @file
  * Reads raw libinput touch events and converts them into our TouchEvent
  */
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <libinput.h>
@@ -80,6 +81,42 @@ static inline int getYInPercent(struct libinput_event_touch* event) {
     return libinput_event_touch_get_y_transformed(event, 100);
 }
 
+/// Events of a single libinput_dispatch that have yet to be written to stdout
+static TouchEventWriteBuffer outputBuffer;
+/// When set, records are published here instead of written to stdout
+static TouchRingWriter* ringWriter;
+
+/// ids of the devices that have been announced; the index is the one used in TouchRecords
+static struct {
+    uint32_t ids[MAX_STREAM_DEVICES];
+    uint32_t size;
+} announcedDevices;
+
+/**
+ * Returns the index of inputDevice in the stream's device table, sending a
+ * DeviceRecord first if it hasn't been announced yet. Once the table is full
+ * the oldest entries are replaced.
+ *
+ * @param inputDevice
+ * @param id product id of inputDevice
+ *
+ * @return the index of the device
+ */
+static uint8_t announceDevice(struct libinput_device* inputDevice, uint32_t id) {
+    for(uint32_t i = 0; i < MIN(announcedDevices.size, MAX_STREAM_DEVICES); i++)
+        if(announcedDevices.ids[i] == id)
+            return i;
+    uint8_t index = announcedDevices.size++ % MAX_STREAM_DEVICES;
+    announcedDevices.ids[index] = id;
+    DeviceRecord record = {.type = DeviceRecordType, .device = index, .id = id};
+    setDeviceRecordNames(&record, libinput_device_get_sysname(inputDevice), libinput_device_get_name(inputDevice));
+    if(ringWriter)
+        setTouchRingDevice(ringWriter, &record);
+    else
+        bufferDeviceRecord(STDOUT_FILENO, &outputBuffer, &record);
+    return index;
+}
+
 void processTouchEvent(struct libinput_event_touch* event, enum libinput_event_type type) {
     GesturePoint point = {};
     GesturePoint pointPixel = {};
@@ -119,11 +156,14 @@ void processTouchEvent(struct libinput_event_touch* event, enum libinput_event_t
             seat = libinput_event_touch_get_seat_slot(event);
             time = libinput_event_touch_get_time(event);
 
-            LargestRawGestureEvent event = {{mask, {id, seat, point, pointPixel, time}}};
+            TouchRecord record = {.type = mask, .touchEvent = {id, seat, point, pointPixel, time}};
             if(mask == TouchStartMask) {
-                setRawGestureEventNames(&event, libinput_device_get_sysname(inputDevice), libinput_device_get_name(inputDevice));
+                record.device = announceDevice(inputDevice, id);
             }
-            writeTouchEvent(STDOUT_FILENO, &event.event);
+            if(ringWriter)
+                publishTouchRecord(ringWriter, &record);
+            else
+                bufferTouchRecord(STDOUT_FILENO, &outputBuffer, &record);
             break;
     }
 }
@@ -133,34 +173,67 @@ void stopGestures() {
     isListening = 0;
 }
 
+/**
+ * Fills fds with everything listenForGestures waits on: libinput, then either
+ * stdout or the ring's listening socket, then each ring reader
+ *
+ * @return the number of fds
+ */
+static int getListenFds(int libinput_fd, struct pollfd fds[2 + MAX_TOUCH_RING_READERS]) {
+    fds[0] = (struct pollfd) {libinput_fd, POLLIN};
+    if(!ringWriter) {
+        fds[1] = (struct pollfd) {STDOUT_FILENO, 0};
+        return 2;
+    }
+    fds[1] = (struct pollfd) {ringWriter->listenFd, POLLIN};
+    for(uint32_t i = 0; i < ringWriter->numReaders; i++)
+        fds[2 + i] = (struct pollfd) {ringWriter->readers[i].socket, POLLIN};
+    return 2 + ringWriter->numReaders;
+}
+
 static int listenForGestures(struct libinput* li) {
     int libinput_fd = libinput_get_fd(li);
-    struct pollfd fds[2] = {{libinput_fd, POLLIN}, {STDOUT_FILENO, 0}};
+    struct pollfd fds[2 + MAX_TOUCH_RING_READERS];
+    if(!ringWriter)
+        bufferTouchStreamHeader(STDOUT_FILENO, &outputBuffer);
     isListening = 1;
     while(isListening) {
-        int ret = poll(fds, LEN(fds), -1);
+        int numFds = getListenFds(libinput_fd, fds);
+        int ret = poll(fds, numFds, -1);
         if (ret == -1) {
-            if (errno == EAGAIN || errno == ENOMEM)
+            if (errno == EAGAIN || errno == ENOMEM || errno == EINTR)
                 continue;
             return -2;
         }
-        for (int i = 0; i < LEN(fds); i++) {
-            if (fds[i].revents & POLLIN) {
-                if (fds[i].fd == libinput_fd) {
-                    if (libinput_dispatch(li)) {
-                        return -1;
-                    }
-                    struct libinput_event* event;
-                    while (event = libinput_get_event(li)) {
-                        enum libinput_event_type type = libinput_event_get_type(event);
-                        processTouchEvent((struct libinput_event_touch*)event, type);
-                        libinput_event_destroy(event);
-                    }
-                }
-            } else if(fds[i].revents & (POLLERR | POLLHUP)) {
-                isListening = 0;
+        if (fds[0].revents & POLLIN) {
+            if (libinput_dispatch(li)) {
+                return -1;
+            }
+            struct libinput_event* event;
+            while (event = libinput_get_event(li)) {
+                enum libinput_event_type type = libinput_event_get_type(event);
+                processTouchEvent((struct libinput_event_touch*)event, type);
+                libinput_event_destroy(event);
             }
+            if(ringWriter)
+                notifyTouchRingReaders(ringWriter);
+            else
+                flushTouchEvents(STDOUT_FILENO, &outputBuffer);
+        } else if(fds[0].revents & (POLLERR | POLLHUP)) {
+            isListening = 0;
         }
+        if(!ringWriter) {
+            if(fds[1].revents & (POLLERR | POLLHUP))
+                isListening = 0;
+            continue;
+        }
+        // readers never send anything so any activity means they are gone
+        for (int i = numFds - 1; i >= 2; i--) {
+            if (fds[i].revents)
+                removeTouchRingReader(ringWriter, i - 2);
+        }
+        if (fds[1].revents & POLLIN)
+            acceptTouchRingReader(ringWriter);
     }
     return 0;
 }
@@ -185,10 +258,26 @@ int startGestures(const char** paths, int num, bool grab) {
 
 int __attribute__((weak)) main(int argc, char* const argv[]) {
     bool grab = 0;
+    const char* ringPath = NULL;
     int i = 1;
-    if(argv[1] && strcmp(argv[1], "--grab")) {
-        i++;
-        grab = 1;
+    for(; i < argc; i++) {
+        if(strcmp(argv[i], "--grab") == 0)
+            grab = 1;
+        else if(strcmp(argv[i], "--ring") == 0 && i + 1 < argc)
+            ringPath = argv[++i];
+        else
+            break;
+    }
+    static TouchRingWriter writer;
+    if(ringPath) {
+        if(createTouchRing(&writer, ringPath, DEFAULT_TOUCH_RING_CAPACITY) == -1) {
+            perror("Failed to create ring");
+            return 1;
+        }
+        ringWriter = &writer;
     }
-    return startGestures((const char**)(argv + 1), argc - i, grab);
+    int ret = startGestures((const char**)(argv + i), argc - i, grab);
+    if(ringWriter)
+        closeTouchRing(ringWriter);
+    return ret;
 }
@@ -0,0 +1,267 @@
+/**
+ * @file
+ *
+ * Reads the streams of several writers at once and processes their records
+ * in TouchEvent::time order.
+ *
+ * Records are held in a min heap ordered by time until either a record at
+ * least reorderWindow ms newer has been received from any source or no
+ * records have been received for reorderWindow ms, so a late record is only
+ * put back in order if it is less than reorderWindow ms late and a slow
+ * source never holds back the others for longer than that
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "gestures-private.h"
+#include "touch.h"
+
+/// Max number of records held at once; the oldest is processed early when full
+#define MAX_MERGED_RECORDS (1 << 10)
+#define MAX_EPOLL_EVENTS 16
+
+typedef struct {
+    TouchRecord record;
+    /// time the record is ordered by; never older than an earlier record of the same source
+    uint32_t time;
+    /// number of records received before this one; breaks ties so each source stays in order
+    uint64_t order;
+    /// names of the record's device; only set for TouchStartMask
+    char sysName[DEVICE_NAME_LEN];
+    char name[DEVICE_NAME_LEN];
+} MergedRecord;
+
+typedef struct {
+    int fd;
+    TouchStream* stream;
+    /// time of the last record received
+    uint32_t lastTime;
+    bool hasTime;
+    bool closed;
+} TouchEventSource;
+
+struct TouchEventMerger {
+    int epollFd;
+    uint32_t reorderWindow;
+    TouchEventSource* sources;
+    uint32_t numSources;
+    uint32_t openSources;
+    /// source being read; records decoded by holdTouchRecord belong to it
+    uint32_t currentSource;
+    /// newest time of any record received
+    uint32_t maxTime;
+    bool hasTime;
+    /// set when records are received and cleared once lastArrival is updated
+    bool received;
+    /// CLOCK_MONOTONIC ms when records were last received
+    uint64_t lastArrival;
+    uint64_t nextOrder;
+    MergedRecord records[MAX_MERGED_RECORDS];
+    /// indices of unused records
+    uint32_t freeRecords[MAX_MERGED_RECORDS];
+    uint32_t numFreeRecords;
+    /// indices of held records ordered as a min heap
+    uint32_t heap[MAX_MERGED_RECORDS];
+    uint32_t heapSize;
+};
+
+/**
+ * @return true if TouchEvent time a is before b, allowing for the ms counter wrapping
+ */
+static inline bool isBefore(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+static inline bool isHeapBefore(const TouchEventMerger* merger, uint32_t a, uint32_t b) {
+    const MergedRecord* recordA = &merger->records[merger->heap[a]];
+    const MergedRecord* recordB = &merger->records[merger->heap[b]];
+    return recordA->time != recordB->time ? isBefore(recordA->time, recordB->time) : recordA->order < recordB->order;
+}
+
+static inline void swapHeap(TouchEventMerger* merger, uint32_t a, uint32_t b) {
+    uint32_t temp = merger->heap[a];
+    merger->heap[a] = merger->heap[b];
+    merger->heap[b] = temp;
+}
+
+static void pushHeap(TouchEventMerger* merger, uint32_t index) {
+    uint32_t i = merger->heapSize++;
+    merger->heap[i] = index;
+    for(; i && isHeapBefore(merger, i, (i - 1) / 2); i = (i - 1) / 2)
+        swapHeap(merger, i, (i - 1) / 2);
+}
+
+static uint32_t popHeap(TouchEventMerger* merger) {
+    uint32_t top = merger->heap[0];
+    merger->heap[0] = merger->heap[--merger->heapSize];
+    for(uint32_t i = 0;;) {
+        uint32_t smallest = i;
+        for(uint32_t child = 2 * i + 1; child <= 2 * i + 2 && child < merger->heapSize; child++)
+            if(isHeapBefore(merger, child, smallest))
+                smallest = child;
+        if(smallest == i)
+            break;
+        swapHeap(merger, i, smallest);
+        i = smallest;
+    }
+    return top;
+}
+
+/**
+ * Processes the oldest held record
+ */
+static void releaseTouchRecord(TouchEventMerger* merger) {
+    uint32_t index = popHeap(merger);
+    const MergedRecord* record = &merger->records[index];
+    processTouchRecord(&record->record, record->sysName, record->name);
+    merger->freeRecords[merger->numFreeRecords++] = index;
+}
+
+static void holdTouchRecord(void* arg, const TouchRecord* record, const char* sysName, const char* name) {
+    TouchEventMerger* merger = arg;
+    TouchEventSource* source = &merger->sources[merger->currentSource];
+    if(merger->heapSize == MAX_MERGED_RECORDS)
+        releaseTouchRecord(merger);
+    uint32_t time = record->touchEvent.time;
+    if(source->hasTime && isBefore(time, source->lastTime))
+        time = source->lastTime;
+    source->lastTime = time;
+    source->hasTime = 1;
+    if(!merger->hasTime || isBefore(merger->maxTime, time)) {
+        merger->maxTime = time;
+        merger->hasTime = 1;
+    }
+    uint32_t index = merger->freeRecords[--merger->numFreeRecords];
+    MergedRecord* dest = &merger->records[index];
+    dest->record = *record;
+    dest->record.touchEvent.id ^= merger->currentSource << MERGED_SOURCE_SHIFT;
+    dest->time = time;
+    dest->order = merger->nextOrder++;
+    if(record->type == TouchStartMask) {
+        strncpy(dest->sysName, sysName, DEVICE_NAME_LEN - 1);
+        strncpy(dest->name, name, DEVICE_NAME_LEN - 1);
+        dest->sysName[DEVICE_NAME_LEN - 1] = 0;
+        dest->name[DEVICE_NAME_LEN - 1] = 0;
+    }
+    pushHeap(merger, index);
+    merger->received = 1;
+}
+
+static inline uint64_t getMonotonicTimeMs() {
+    return getMonotonicTimeNs() / 1000000;
+}
+
+/**
+ * Processes every held record that is no longer waiting for older records
+ */
+static void releaseDueRecords(TouchEventMerger* merger, uint64_t now) {
+    bool quiet = now >= merger->lastArrival + merger->reorderWindow;
+    while(merger->heapSize) {
+        uint32_t time = merger->records[merger->heap[0]].time;
+        if(!quiet && isBefore(merger->maxTime, time + merger->reorderWindow))
+            break;
+        releaseTouchRecord(merger);
+    }
+}
+
+TouchEventMerger* createTouchEventMerger(uint32_t reorderWindow) {
+    TouchEventMerger* merger = calloc(1, sizeof(TouchEventMerger));
+    if(!merger)
+        return NULL;
+    merger->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(merger->epollFd == -1) {
+        free(merger);
+        return NULL;
+    }
+    merger->reorderWindow = reorderWindow;
+    for(uint32_t i = 0; i < MAX_MERGED_RECORDS; i++)
+        merger->freeRecords[i] = MAX_MERGED_RECORDS - 1 - i;
+    merger->numFreeRecords = MAX_MERGED_RECORDS;
+    return merger;
+}
+
+int addTouchEventSource(TouchEventMerger* merger, int fd) {
+    if(merger->numSources == MAX_MERGED_SOURCES)
+        return -1;
+    TouchEventSource* sources = realloc(merger->sources, sizeof(TouchEventSource) * (merger->numSources + 1));
+    if(!sources)
+        return -1;
+    merger->sources = sources;
+    TouchEventSource* source = &sources[merger->numSources];
+    *source = (TouchEventSource) {.fd = fd, .stream = createTouchStream(holdTouchRecord, merger)};
+    struct epoll_event event = {.events = EPOLLIN | EPOLLET, .data.u32 = merger->numSources};
+    if(!source->stream || epoll_ctl(merger->epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        free(source->stream);
+        return -1;
+    }
+    merger->numSources++;
+    merger->openSources++;
+    return 0;
+}
+
+int getTouchEventMergerFd(const TouchEventMerger* merger) {
+    return merger->epollFd;
+}
+
+int getTouchEventMergerTimeout(const TouchEventMerger* merger) {
+    if(!merger->heapSize)
+        return -1;
+    uint64_t now = getMonotonicTimeMs();
+    uint64_t due = merger->lastArrival + merger->reorderWindow;
+    return now >= due ? 0 : (int)(due - now);
+}
+
+static void closeTouchEventSource(TouchEventMerger* merger, uint32_t index) {
+    TouchEventSource* source = &merger->sources[index];
+    epoll_ctl(merger->epollFd, EPOLL_CTL_DEL, source->fd, NULL);
+    source->closed = 1;
+    merger->openSources--;
+}
+
+TouchReadStatus processTouchEventMerger(TouchEventMerger* merger, int timeout) {
+    int heldTimeout = getTouchEventMergerTimeout(merger);
+    if(heldTimeout != -1 && (timeout < 0 || heldTimeout < timeout))
+        timeout = heldTimeout;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int num = merger->openSources ? epoll_wait(merger->epollFd, events, MAX_EPOLL_EVENTS, timeout) : 0;
+    if(num == -1 && errno != EINTR)
+        return TOUCH_READ_ERROR;
+    TouchReadStatus status = TOUCH_READ_AGAIN;
+    for(int i = 0; i < num; i++) {
+        uint32_t index = events[i].data.u32;
+        if(merger->sources[index].closed)
+            continue;
+        merger->currentSource = index;
+        TouchReadStatus ret = readPendingTouchStream(merger->sources[index].stream, merger->sources[index].fd);
+        if(ret == TOUCH_READ_AGAIN)
+            continue;
+        // a source that failed can't be read past the failure so it is treated as closed
+        closeTouchEventSource(merger, index);
+        if(ret != TOUCH_READ_EOF)
+            status = ret;
+    }
+    uint64_t now = getMonotonicTimeMs();
+    if(merger->received) {
+        merger->lastArrival = now;
+        merger->received = 0;
+    }
+    if(!merger->openSources) {
+        while(merger->heapSize)
+            releaseTouchRecord(merger);
+        return status == TOUCH_READ_AGAIN ? TOUCH_READ_EOF : status;
+    }
+    releaseDueRecords(merger, now);
+    return status;
+}
+
+void freeTouchEventMerger(TouchEventMerger* merger) {
+    for(uint32_t i = 0; i < merger->numSources; i++)
+        free(merger->sources[i].stream);
+    free(merger->sources);
+    close(merger->epollFd);
+    free(merger);
+}
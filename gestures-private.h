@@ -1,7 +1,11 @@
 #ifndef GESTURES_PRIVATE_H
 #define GESTURES_PRIVATE_H
 
+#include "event.h"
+#include "gestures.h"
+
 #define LEN(X) (sizeof X / sizeof X[0])
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
 
 
 #define ADD_POINT(dest, delta) do{dest.x+=delta.x; dest.y+=delta.y;}while(0)
@@ -19,4 +23,122 @@
 /// The cutoff for when a sequence of points forms a line
 #define R_SQUARED_THRESHOLD .5
 
+/**
+ * The groups and gestures a recognizer keeps between TouchEvents.
+ * startGesture and the like use the calling thread's current state, which is
+ * the default context's state unless changed
+ */
+typedef struct RecognizerState RecognizerState;
+/// Bytes of a writer's stream waiting to be processed
+typedef struct TouchStream TouchStream;
+/// Receives the TouchRecords decoded from a TouchStream in place of processTouchRecord
+typedef void (*TouchRecordSink)(void* arg, const TouchRecord* record, const char* sysName, const char* name);
+/**
+ * @param sink called with every valid record decoded or NULL to process them
+ * @param arg passed to sink
+ * @return a new stream to be freed with free() or NULL on error
+ */
+TouchStream* createTouchStream(TouchRecordSink sink, void* arg);
+/**
+ * processPendingTouchEvents for a stream other than the current context's
+ */
+TouchReadStatus readPendingTouchStream(TouchStream* stream, int fd);
+
+struct GestureContext {
+    /// GestureMasks of the events to generate
+    uint32_t selectMask;
+    /// GestureMasks of the events whose derived flags and motion are computed
+    uint32_t derivedMask;
+    void (*handler)(GestureEvent* event);
+    /// Bindings whose details are tracked while gestures are in progress
+    const GestureBindingRegistry* prefixRegistry;
+    uint32_t seqCounter;
+    /// state used when the context is given to a function
+    RecognizerState* state;
+    /// allocated the first time the context reads a stream
+    TouchStream* stream;
+};
+
+/**
+ * @return the context of the calling thread's current state
+ */
+GestureContext* getGestureContext();
+GestureContext* getDefaultGestureContext();
+
+/**
+ * @param context the context whose events are generated by the new state
+ */
+RecognizerState* createRecognizerState(GestureContext* context);
+/**
+ * Makes state the calling thread's current state
+ *
+ * @param state the new state or NULL for the default state
+ * @return the previous state
+ */
+RecognizerState* setRecognizerState(RecognizerState* state);
+/**
+ * Frees state and every gesture in progress in it without generating any events
+ *
+ * @param state the state to free; may be NULL
+ */
+void freeRecognizerState(RecognizerState* state);
+
+/**
+ * Applies record to the calling thread's RecognizerState; record's type must be valid
+ */
+void handleTouchRecord(const TouchRecord* record, const char* sysName, const char* name);
+/// @{ Used by processTouchRecord to hand records to gesture shards
+bool areGestureShardsRunning();
+void routeTouchRecord(const TouchRecord* record, const char* sysName, const char* name);
+/// @}
+/**
+ * Allows events to be generated by multiple threads at once
+ */
+void setMultipleEventProducers(bool multiple);
+
+/// @{ Updates the counters returned by getGestureStats
+void recordHandledGestureEvent(GestureMask mask, ProductID device, uint32_t time, uint64_t handlerStart, uint64_t handlerEnd);
+void recordUnselectedGestureEvent();
+void recordDroppedGestureEvent();
+void recordGestureEventAllocation();
+/// @}
+uint64_t getMonotonicTimeNs();
+
+/// Tracks when consecutive lines of a stroke are long enough to add a new direction
+typedef struct {
+    /// the last direction added
+    GestureType lastDir;
+    /// a direction different from lastDir that has been seen pendingCount times in a row
+    GestureType pendingDir;
+    int pendingCount;
+} StrokeState;
+
+/**
+ * Feeds the direction of the next accepted line of a stroke to state.
+ * If a direction is returned, the caller should call commitStrokeDirection once it has been added
+ *
+ * @param state
+ * @param dir
+ *
+ * @return dir if a new direction should be added otherwise GESTURE_NONE
+ */
+static inline GestureType advanceStroke(StrokeState* state, GestureType dir) {
+    if(dir == state->lastDir) {
+        state->pendingCount = 0;
+        return GESTURE_NONE;
+    }
+    if(state->pendingDir != dir) {
+        state->pendingDir = dir;
+        state->pendingCount = 0;
+    }
+    if(++state->pendingCount < MIN_LINE_LEN)
+        return GESTURE_NONE;
+    state->pendingCount = 0;
+    return dir;
+}
+
+static inline void commitStrokeDirection(StrokeState* state, GestureType dir) {
+    state->lastDir = dir;
+}
+
 #endif
@@ -3,40 +3,321 @@
  *
  * Reads TouchEvents written by gestures-libpinput-writer
  */
-#define _POSIX_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <limits.h>
 #include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "gestures-private.h"
 #include "touch.h"
 
+/// Max number of bytes read at once; must be able to hold at least one LargestRawGestureEvent
+#define TOUCH_EVENT_BUFFER_SIZE (1 << 12)
+/**
+ * Raw bytes read from the writer. Bytes in [start, end) have been read but
+ * not yet processed; they may end with an incomplete event
+ */
+struct TouchStream {
+    char buffer[TOUCH_EVENT_BUFFER_SIZE];
+    uint32_t start;
+    uint32_t end;
+    /// 0 until the first bytes of the stream have been seen
+    uint32_t version;
+    /// names of the devices announced by a v2 stream
+    struct {
+        char sysName[DEVICE_NAME_LEN];
+        char name[DEVICE_NAME_LEN];
+    } devices[MAX_STREAM_DEVICES];
+    /// given every decoded TouchRecord instead of processTouchRecord when set
+    TouchRecordSink sink;
+    void* sinkArg;
+};
+
+TouchStream* createTouchStream(TouchRecordSink sink, void* arg) {
+    TouchStream* stream = calloc(1, sizeof(TouchStream));
+    if(stream) {
+        stream->sink = sink;
+        stream->sinkArg = arg;
+    }
+    return stream;
+}
+
+/**
+ * @return the stream of the calling thread's current context
+ */
+static TouchStream* getTouchStream() {
+    GestureContext* context = getGestureContext();
+    if(!context->stream)
+        context->stream = createTouchStream(NULL, NULL);
+    return context->stream;
+}
+
 bool isTouchEventReady(int32_t fd) {
     struct pollfd event = {fd, POLLIN};
-    return poll(&event, 2, -1) > 0 && event.revents & POLLIN;
+    int ret;
+    while((ret = poll(&event, 1, -1)) == -1 && errno == EINTR);
+    return ret > 0 && event.revents & POLLIN;
+}
+
+static void processTouchStart(const TouchRecord* record, const char* sysName, const char* name) {
+    startGesture(record->touchEvent, sysName, name);
+}
+static void processTouchMotion(const TouchRecord* record, const char* sysName __attribute__((unused)), const char* name __attribute__((unused))) {
+    continueGesture(record->touchEvent);
+}
+static void processTouchEnd(const TouchRecord* record, const char* sysName __attribute__((unused)), const char* name __attribute__((unused))) {
+    endGesture(record->touchEvent);
+}
+static void processTouchCancel(const TouchRecord* record, const char* sysName __attribute__((unused)), const char* name __attribute__((unused))) {
+    cancelGesture(record->touchEvent);
+}
+/// How to process each valid TouchRecord type
+static void (*const touchRecordHandlers[UINT8_MAX + 1])(const TouchRecord* record, const char* sysName, const char* name) = {
+    [TouchStartMask] = processTouchStart,
+    [TouchMotionMask] = processTouchMotion,
+    [TouchEndMask] = processTouchEnd,
+    [TouchCancelMask] = processTouchCancel,
+};
+
+void handleTouchRecord(const TouchRecord* record, const char* sysName, const char* name) {
+    touchRecordHandlers[record->type](record, sysName, name);
+}
+
+int processTouchRecord(const TouchRecord* record, const char* sysName, const char* name) {
+    if(!touchRecordHandlers[record->type])
+        return -1;
+    if(areGestureShardsRunning())
+        routeTouchRecord(record, sysName, name);
+    else
+        handleTouchRecord(record, sysName, name);
+    return 1;
 }
 
-#define safe_read(FD, VAR, SIZE)do {int ret = read(FD, VAR, SIZE); if(ret <= 0) return ret;} while(0)
-bool readTouchEvent(uint32_t fd) {
-    char buffer[DEVICE_NAME_LEN * 2];
+static inline int processStreamTouchRecord(TouchStream* stream, const TouchRecord* record) {
+    const char* sysName = stream->devices[record->device].sysName;
+    const char* name = stream->devices[record->device].name;
+    if(!stream->sink)
+        return processTouchRecord(record, sysName, name);
+    if(!touchRecordHandlers[record->type])
+        return -1;
+    stream->sink(stream->sinkArg, record, sysName, name);
+    return 1;
+}
+
+/**
+ * Processes the v1 event at the start of the buffer
+ *
+ * @return the size of the event, 0 if it is incomplete or -1 if it is malformed
+ */
+static int dispatchRawGestureEvent(TouchStream* stream) {
+    uint32_t available = stream->end - stream->start;
+    if(available < sizeof(RawGestureEvent))
+        return 0;
     RawGestureEvent event;
-    safe_read(fd, &event, sizeof(event));
-    switch(event.mask) {
-        case TouchStartMask:
-            safe_read(fd, buffer, event.totalNameLen);
-            startGesture(event.touchEvent,  buffer, buffer + strnlen(buffer, DEVICE_NAME_LEN));
-            break;
-        case TouchMotionMask:
-            continueGesture(event.touchEvent);
-            break;
-        case TouchEndMask:
-            endGesture(event.touchEvent);
-            break;
-        case TouchCancelMask:
-            cancelGesture(event.touchEvent);
+    memcpy(&event, stream->buffer + stream->start, sizeof(event));
+    uint32_t size = sizeof(RawGestureEvent) + event.totalNameLen;
+    if(available < size)
+        return 0;
+    if(!touchRecordHandlers[event.mask])
+        return -1;
+    if(event.mask == TouchStartMask) {
+        // v1 streams don't have a device table so device 0 is overwritten by every TouchStart
+        const char* names = stream->buffer + stream->start + sizeof(RawGestureEvent);
+        uint32_t sysNameLen = strnlen(names, event.totalNameLen);
+        uint32_t nameOffset = MIN(sysNameLen + 1, event.totalNameLen);
+        snprintf(stream->devices[0].sysName, DEVICE_NAME_LEN, "%.*s", sysNameLen, names);
+        snprintf(stream->devices[0].name, DEVICE_NAME_LEN, "%.*s", event.totalNameLen - nameOffset, names + nameOffset);
+    }
+    TouchRecord record = {.type = event.mask, .touchEvent = event.touchEvent};
+    processStreamTouchRecord(stream, &record);
+    return size;
+}
+
+/**
+ * Processes the v2 record at the start of the buffer
+ *
+ * @return the size of the record, 0 if it is incomplete or -1 if it is malformed
+ */
+static int dispatchTouchRecord(TouchStream* stream, bool* isTouchRecord) {
+    uint32_t available = stream->end - stream->start;
+    if(available < sizeof(TouchRecord))
+        return 0;
+    const char* data = stream->buffer + stream->start;
+    *isTouchRecord = (uint8_t)data[0] != DeviceRecordType;
+    if(*isTouchRecord) {
+        TouchRecord record;
+        memcpy(&record, data, sizeof(record));
+        return processStreamTouchRecord(stream, &record) == -1 ? -1 : (int)sizeof(TouchRecord);
+    }
+    if(available < sizeof(DeviceRecord))
+        return 0;
+    DeviceRecord record;
+    memcpy(&record, data, sizeof(record));
+    memcpy(stream->devices[record.device].sysName, record.sysName, DEVICE_NAME_LEN);
+    memcpy(stream->devices[record.device].name, record.name, DEVICE_NAME_LEN);
+    stream->devices[record.device].sysName[DEVICE_NAME_LEN - 1] = 0;
+    stream->devices[record.device].name[DEVICE_NAME_LEN - 1] = 0;
+    return sizeof(DeviceRecord);
+}
+
+/**
+ * Determines the version of the stream from its first bytes
+ *
+ * @return the number of header bytes to skip or -1 if the version isn't supported.
+ * The version is left unset if more bytes are needed
+ */
+static int detectStreamVersion(TouchStream* stream) {
+    uint32_t available = stream->end - stream->start;
+    if(!available || stream->buffer[stream->start] == (char)(TOUCH_STREAM_MAGIC & 0xFF) && available < sizeof(TouchStreamHeader))
+        return 0;
+    TouchStreamHeader header = {0};
+    if(available >= sizeof(header))
+        memcpy(&header, stream->buffer + stream->start, sizeof(header));
+    if(header.magic != TOUCH_STREAM_MAGIC) {
+        stream->version = 1;
+        return 0;
+    }
+    if(header.version != TOUCH_STREAM_VERSION)
+        return -1;
+    stream->version = header.version;
+    return sizeof(header);
+}
+
+/**
+ * Processes up to max complete events that have already been read
+ *
+ * @return the number of events processed or -1 if a malformed event was found
+ */
+static int dispatchBufferedTouchEvents(TouchStream* stream, int max) {
+    if(!stream->version) {
+        int headerSize = detectStreamVersion(stream);
+        if(headerSize == -1)
+            return -1;
+        if(!stream->version)
+            return 0;
+        stream->start += headerSize;
+    }
+    int count = 0;
+    while(count < max) {
+        bool isTouchEvent = true;
+        int size = stream->version == 1 ? dispatchRawGestureEvent(stream) : dispatchTouchRecord(stream, &isTouchEvent);
+        if(size <= 0) {
+            if(size == -1)
+                return -1;
             break;
-        default:
+        }
+        stream->start += size;
+        count += isTouchEvent;
+    }
+    return count;
+}
+
+/**
+ * Moves the unprocessed bytes to the start of the buffer
+ */
+static void compactBuffer(TouchStream* stream) {
+    if(stream->start) {
+        memmove(stream->buffer, stream->buffer + stream->start, stream->end - stream->start);
+        stream->end -= stream->start;
+        stream->start = 0;
+    }
+}
+
+/**
+ * Reads as many bytes as are available and fit into the buffer
+ *
+ * @return the return value of read
+ */
+static int fillBuffer(TouchStream* stream, uint32_t fd) {
+    compactBuffer(stream);
+    int ret = read(fd, stream->buffer + stream->end, TOUCH_EVENT_BUFFER_SIZE - stream->end);
+    if(ret > 0)
+        stream->end += ret;
+    return ret;
+}
+
+int readTouchEvents(uint32_t fd) {
+    TouchStream* stream = getTouchStream();
+    int ret = dispatchBufferedTouchEvents(stream, INT_MAX);
+    if(ret)
+        return ret;
+    ret = fillBuffer(stream, fd);
+    if(ret <= 0)
+        return ret;
+    return dispatchBufferedTouchEvents(stream, INT_MAX) == -1 ? -1 : ret;
+}
+
+int readTouchEvent(uint32_t fd) {
+    TouchStream* stream = getTouchStream();
+    int ret;
+    while((ret = dispatchBufferedTouchEvents(stream, 1)) == 0) {
+        ret = fillBuffer(stream, fd);
+        if(ret <= 0)
+            return ret;
+    }
+    return ret;
+}
+
+int processTouchEventBytes(const void* data, uint32_t size) {
+    TouchStream* stream = getTouchStream();
+    int count = 0;
+    while(size) {
+        compactBuffer(stream);
+        uint32_t chunkSize = MIN(size, TOUCH_EVENT_BUFFER_SIZE - stream->end);
+        memcpy(stream->buffer + stream->end, data, chunkSize);
+        stream->end += chunkSize;
+        data = (const char*)data + chunkSize;
+        size -= chunkSize;
+        int ret = dispatchBufferedTouchEvents(stream, INT_MAX);
+        if(ret == -1)
             return -1;
+        count += ret;
     }
-    return 1;
+    return count;
+}
+
+int readTouchEventInContext(GestureContext* context, uint32_t fd) {
+    RecognizerState* old = setRecognizerState(context->state);
+    int ret = readTouchEvent(fd);
+    setRecognizerState(old);
+    return ret;
+}
+
+int readTouchEventsInContext(GestureContext* context, uint32_t fd) {
+    RecognizerState* old = setRecognizerState(context->state);
+    int ret = readTouchEvents(fd);
+    setRecognizerState(old);
+    return ret;
+}
+
+TouchReadStatus readPendingTouchStream(TouchStream* stream, int fd) {
+    if(dispatchBufferedTouchEvents(stream, INT_MAX) == -1)
+        return TOUCH_READ_MALFORMED;
+    while(1) {
+        int ret = fillBuffer(stream, fd);
+        if(ret == -1) {
+            if(errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? TOUCH_READ_AGAIN : TOUCH_READ_ERROR;
+        }
+        if(ret == 0)
+            return TOUCH_READ_EOF;
+        if(dispatchBufferedTouchEvents(stream, INT_MAX) == -1)
+            return TOUCH_READ_MALFORMED;
+    }
+}
+
+TouchReadStatus processPendingTouchEvents(int fd) {
+    return readPendingTouchStream(getTouchStream(), fd);
+}
+
+TouchReadStatus processPendingTouchEventsInContext(GestureContext* context, int fd) {
+    RecognizerState* old = setRecognizerState(context->state);
+    TouchReadStatus ret = processPendingTouchEvents(fd);
+    setRecognizerState(old);
+    return ret;
 }
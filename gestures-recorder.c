@@ -9,22 +9,41 @@
 #define SQUARE(X) ((X)*(X))
 #define SQ_DIST(P1,P2) SQUARE(P1.x-P2.x)+SQUARE(P1.y-P2.y)
 
-/// Used to determine if a line as a positive, 0 or negative slope
-#define SIGN_THRESHOLD(X) ((X)>.5?1:(X)>=-.5?0:-1)
+/**
+ * sin^2(30deg) as a fraction. A line has a positive or negative x (or y) component
+ * iff |dx| > sin(30deg) * length, i.e. dx^2 * DEN > (dx^2 + dy^2) * NUM.
+ * The comparison is exact so lines within a few ulps of 30 or 60 degrees can be
+ * classified differently than the rounded floating point division once used
+ */
+#define DIRECTION_THRESHOLD_NUM 1
+#define DIRECTION_THRESHOLD_DEN 4
+
+/**
+ * @return the sign of d if d's share of the line is large enough otherwise 0
+ */
+static inline int getDirectionSign(int32_t d, int32_t other) {
+    uint64_t d2 = (uint64_t)((int64_t)d * d), other2 = (uint64_t)((int64_t)other * other);
+    if(d2 * (DIRECTION_THRESHOLD_DEN - DIRECTION_THRESHOLD_NUM) > other2 * DIRECTION_THRESHOLD_NUM)
+        return d > 0 ? 1 : -1;
+    return 0;
+}
 
 GestureType getLineType(const GesturePoint start, const GesturePoint end) {
-    double dx = end.x - start.x, dy = end.y - start.y;
-    double sum = sqrt(SQUARE(dx) + SQUARE(dy));
-    int x = ((SIGN_THRESHOLD(dx / sum)));
-    int y = ((SIGN_THRESHOLD(dy / sum)));
-    GestureType type = GESTURE_WEST + (2 + x) * y - (2 * x + 2) * (!y);
-    assert(type < 16);
-    return type;
+    int32_t dx = end.x - start.x, dy = end.y - start.y;
+    // a 0 length line has historically been NORTH_WEST
+    if(!dx && !dy)
+        return GESTURE_NORTH_WEST;
+    int x = getDirectionSign(dx, dy);
+    int y = getDirectionSign(dy, dx);
+    return GESTURE_WEST + (2 + x) * y - (2 * x + 2) * (!y);
 }
 
 struct GestureGroup;
 typedef struct Gesture {
     struct Gesture* next;
+    struct Gesture* prev;
+    /// an older unfinished Gesture with the same id that will be found once this one is finished
+    struct Gesture* shadowed;
     struct GestureGroup* parent;
     TouchID id;
     bool finished;
@@ -33,67 +52,109 @@ typedef struct Gesture {
     GesturePoint firstPercentPoint;
     GesturePoint lastPoint;
     GesturePoint lastPercentPoint;
-    GestureType lastDir;
-
-    int pendingCount;
-    GestureType pendingDir;
+    StrokeState stroke;
     int numPoints;
     uint32_t start;
     GestureFlags flags;
     bool truncated;
+    /// hash info would have after each of gestureReflectionMasks
+    uint32_t transformHashes[5];
+    /// node of prefixRegistry's prefix trie reached by info or NO_GESTURE_PREFIX
+    uint32_t prefixNode;
+    /// number of types of info already used to advance prefixNode
+    uint8_t prefixSize;
+    /// true once a GestureMatchMask or GestureNoMatchMask event has been generated
+    bool prefixResolved;
 } Gesture ;
 
-GestureType getGestureType(const GestureDetail detail, int N) {
-    return detail[N] ;
+static inline void replaceGestureType(GestureDetail* detail, int N, GestureType type) {
+    detail->hash += GESTURE_DETAIL_HASH_TERM(N, type) - GESTURE_DETAIL_HASH_TERM(N, getGestureType(*detail, N));
+    detail->packed[N / 2] = (detail->packed[N / 2] & (0xF0 >> (N % 2 * 4))) | type << (N % 2 * 4);
 }
 
-int getNumOfTypes(const GestureDetail detail) {
-    for(int i = 0; i < MAX_GESTURE_DETAIL_SIZE; i++)
-        if(getGestureType(detail, i) == GESTURE_NONE)
-            return i;
-    return MAX_GESTURE_DETAIL_SIZE;
-}
-
-bool areDetailsEqual(const GestureDetail detail, const GestureDetail detail2) {
-    return memcmp(detail, detail2, sizeof(GestureDetail)) == 0;
+bool appendGestureType(GestureDetail* detail, GestureType type) {
+    if(detail->size == MAX_GESTURE_DETAIL_SIZE)
+        return 0;
+    replaceGestureType(detail, detail->size++, type);
+    return 1;
 }
 
+/// The transforms a group of gestures is checked against; Rotate90Mask and Rotate270Mask are both reported as Rotate90Mask
+static const TransformMasks gestureReflectionMasks[] = {MirroredMask, MirroredXMask, MirroredYMask, Rotate90Mask, Rotate270Mask};
 
 static inline bool addGestureType(Gesture* g, GestureType type) {
-    if(getNumOfTypes(g->info) == MAX_GESTURE_DETAIL_SIZE) {
+    if(!appendGestureType(&g->info, type)) {
         g->truncated = true;
         return 0;
     }
-    g->info[getNumOfTypes(g->info)] = type;
+    int N = getNumOfTypes(g->info) - 1;
+    for(uint32_t i = 0; i < LEN(gestureReflectionMasks); i++)
+        g->transformHashes[i] += GESTURE_DETAIL_HASH_TERM(N, getReflection(gestureReflectionMasks[i], type));
     return 1;
 }
 
-static inline void setGestureType(GestureDetail detail, GestureType type) {
-    assert(getNumOfTypes(detail) == 0);
-    detail[0] = type;
+static inline void setGestureType(GestureDetail* detail, GestureType type) {
+    assert(getNumOfTypes(*detail) == 0);
+    appendGestureType(detail, type);
+}
+
+/**
+ * Sums over the first and last points of every gesture of a group. Kept up to
+ * date as points are added so the group's motion is known without visiting
+ * every gesture
+ */
+typedef struct {
+    /// sum of the first and last points
+    int64_t firstX, firstY, lastX, lastY;
+    /// sum of the squared norms of the first and last points
+    int64_t firstSq, lastSq;
+    /// sum of the dot and cross products of the first and last points
+    int64_t dot, cross;
+} GroupSums;
+
+typedef struct GestureGroup {
+    GestureGroupID id;
+    Gesture root;
+    int activeCount ;
+    int finishedCount ;
+    GroupSums sums;
+    /// sum of totalSqDistance of every gesture
+    uint32_t totalSqDistance;
+    /// earliest start of any gesture
+    uint32_t minStartTime;
+    char sysName[DEVICE_NAME_LEN];
+    char name[DEVICE_NAME_LEN];
+} GestureGroup ;
+
+/**
+ * Adds (sign = 1) or removes (sign = -1) the contribution of a gesture with the given points
+ */
+static inline void updateGroupSums(GroupSums* sums, GesturePoint first, GesturePoint last, int sign) {
+    sums->firstX += sign * first.x;
+    sums->firstY += sign * first.y;
+    sums->lastX += sign * last.x;
+    sums->lastY += sign * last.y;
+    sums->firstSq += sign * ((int64_t)first.x * first.x + (int64_t)first.y * first.y);
+    sums->lastSq += sign * ((int64_t)last.x * last.x + (int64_t)last.y * last.y);
+    sums->dot += sign * ((int64_t)first.x * last.x + (int64_t)first.y * last.y);
+    sums->cross += sign * ((int64_t)first.x * last.y - (int64_t)first.y * last.x);
 }
 
 static inline bool addGesturePoint(Gesture* g, GesturePoint point, GesturePoint pixelPoint, bool first) {
-    if(!first) {
+    if(first)
+        updateGroupSums(&g->parent->sums, point, point, 1);
+    else {
         GesturePoint lastPoint = g->lastPoint;
         uint32_t distance = SQ_DIST(lastPoint, point);
         if(distance < THRESHOLD_SQ)
             return 0;
         g->flags.totalSqDistance = g->flags.totalSqDistance + distance;
-        GestureType dir = getLineType(g->lastPoint, point);
-        if(dir != g->lastDir) {
-            if(g->pendingDir != dir) {
-                g->pendingDir = dir;
-                g->pendingCount = 0;
-            }
-            if(++g->pendingCount >= MIN_LINE_LEN) {
-                g->pendingCount = 0;
-                if(addGestureType(g, dir))
-                    g->lastDir = dir;
-            }
-        }
-        else
-            g->pendingCount = 0;
+        g->parent->totalSqDistance += distance;
+        GestureType dir = advanceStroke(&g->stroke, getLineType(g->lastPoint, point));
+        if(dir != GESTURE_NONE && addGestureType(g, dir))
+            commitStrokeDirection(&g->stroke, dir);
+        updateGroupSums(&g->parent->sums, g->firstPoint, lastPoint, -1);
+        updateGroupSums(&g->parent->sums, g->firstPoint, point, 1);
     }
     g->numPoints++;
     g->lastPoint = point;
@@ -101,16 +162,128 @@ static inline bool addGesturePoint(Gesture* g, GesturePoint point, GesturePoint
     return 1;
 }
 
-typedef struct GestureGroup {
-    struct GestureGroup* next;
-    GestureGroupID id;
-    Gesture root;
-    int activeCount ;
-    int finishedCount ;
-    char sysName[DEVICE_NAME_LEN];
-    char name[DEVICE_NAME_LEN];
-} GestureGroup ;
-static GestureGroup root;
+/**
+ * Open addressing hash map from a TouchID/GestureGroupID to a Gesture/GestureGroup.
+ * A NULL value marks an empty slot
+ */
+typedef struct {
+    uint64_t* keys;
+    void** values;
+    /// number of non-empty slots
+    uint32_t size;
+    /// number of slots; always 0 or a power of 2
+    uint32_t capacity;
+} IDMap;
+
+/// Initial number of slots of an IDMap; maps double once more than half their slots are used
+#define MIN_ID_MAP_CAPACITY 16
+
+static inline uint32_t hashID(uint64_t id) {
+    id ^= id >> 33;
+    id *= 0xFF51AFD7ED558CCDL;
+    id ^= id >> 33;
+    return id;
+}
+
+static uint32_t findSlot(const IDMap* map, uint64_t id) {
+    uint32_t i = hashID(id) & (map->capacity - 1);
+    while(map->values[i] && map->keys[i] != id)
+        i = (i + 1) & (map->capacity - 1);
+    return i;
+}
+
+static void* getID(const IDMap* map, uint64_t id) {
+    return map->capacity ? map->values[findSlot(map, id)] : NULL;
+}
+
+static void putID(IDMap* map, uint64_t id, void* value);
+static void growIDMap(IDMap* map) {
+    IDMap old = *map;
+    map->capacity = old.capacity ? old.capacity * 2 : MIN_ID_MAP_CAPACITY;
+    map->keys = malloc(map->capacity * sizeof(uint64_t));
+    map->values = calloc(map->capacity, sizeof(void*));
+    map->size = 0;
+    for(uint32_t i = 0; i < old.capacity; i++)
+        if(old.values[i])
+            putID(map, old.keys[i], old.values[i]);
+    free(old.keys);
+    free(old.values);
+}
+
+static void putID(IDMap* map, uint64_t id, void* value) {
+    assert(value);
+    if((map->size + 1) * 2 > map->capacity)
+        growIDMap(map);
+    uint32_t i = findSlot(map, id);
+    map->size += !map->values[i];
+    map->keys[i] = id;
+    map->values[i] = value;
+}
+
+/**
+ * Removes id from the map. The following entries of the probe sequence are
+ * shifted back so lookups never need tombstones
+ */
+static void removeID(IDMap* map, uint64_t id, const void* value) {
+    if(!map->capacity)
+        return;
+    uint32_t mask = map->capacity - 1;
+    uint32_t i = findSlot(map, id);
+    if(map->values[i] != value)
+        return;
+    map->values[i] = NULL;
+    map->size--;
+    for(uint32_t j = (i + 1) & mask; map->values[j]; j = (j + 1) & mask) {
+        uint32_t home = hashID(map->keys[j]) & mask;
+        // move j into the hole at i unless its home slot lies cyclically in (i, j]
+        if(((j - home) & mask) >= ((j - i) & mask)) {
+            map->keys[i] = map->keys[j];
+            map->values[i] = map->values[j];
+            map->values[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+/// Everything a recognizer keeps between TouchEvents
+struct RecognizerState {
+    /// All GestureGroups indexed by GestureGroupID
+    IDMap groups;
+    /// The newest unfinished Gesture of every TouchID
+    IDMap activeGestures;
+    GestureContext* context;
+};
+static GestureContext defaultGestureContext;
+static RecognizerState defaultRecognizerState = {.context = &defaultGestureContext};
+static GestureContext defaultGestureContext = {
+    .selectMask = DEFAULT_GESTURE_SELECT_MASK,
+    .derivedMask = -1,
+    .handler = dumpAndFreeGesture,
+    .state = &defaultRecognizerState,
+};
+/// The state TouchEvents are applied to by the calling thread
+static __thread RecognizerState* recognizerState = &defaultRecognizerState;
+
+static void indexGesture(Gesture* gesture) {
+    gesture->shadowed = getID(&recognizerState->activeGestures, gesture->id);
+    putID(&recognizerState->activeGestures, gesture->id, gesture);
+}
+
+static void unindexGesture(Gesture* gesture) {
+    Gesture* head = getID(&recognizerState->activeGestures, gesture->id);
+    if(head == gesture) {
+        removeID(&recognizerState->activeGestures, gesture->id, gesture);
+        if(gesture->shadowed)
+            putID(&recognizerState->activeGestures, gesture->id, gesture->shadowed);
+    }
+    else {
+        for(; head; head = head->shadowed)
+            if(head->shadowed == gesture) {
+                head->shadowed = gesture->shadowed;
+                break;
+            }
+    }
+}
 
 ProductID __attribute__((weak)) generateIDHighBits(const TouchEvent* touchEvent __attribute__((unused))) {
     return 0;
@@ -129,22 +302,20 @@ static GestureGroup* addGroup(GestureGroupID id, const char* sysName, const char
     newNode->id = id;
     strncpy(newNode->sysName, sysName, DEVICE_NAME_LEN - 1);
     strncpy(newNode->name, name, DEVICE_NAME_LEN - 1);
-    newNode->next = root.next;
-    root.next = newNode;
+    putID(&recognizerState->groups, id, newNode);
     return newNode;
 }
 
 static void removeGroup(GestureGroup* group) {
-    for(GestureGroup* node = &root; node; node = node->next)
-        if(node->next == group) {
-            node->next = group->next;
-            for(Gesture* gesture = group->root.next; gesture;) {
-                Gesture* temp = gesture->next;
-                free(gesture);
-                gesture = temp;
-            }
-            free(group);
-        }
+    removeID(&recognizerState->groups, group->id, group);
+    for(Gesture* gesture = group->root.next; gesture;) {
+        Gesture* temp = gesture->next;
+        if(!gesture->finished)
+            unindexGesture(gesture);
+        free(gesture);
+        gesture = temp;
+    }
+    free(group);
 }
 
 static Gesture* createGesture(GestureGroup* group, TouchEvent event) {
@@ -153,48 +324,115 @@ static Gesture* createGesture(GestureGroup* group, TouchEvent event) {
     gesture->id = id;
     gesture->parent = group;
     gesture->next = group->root.next;
+    gesture->prev = &group->root;
+    if(gesture->next)
+        gesture->next->prev = gesture;
     group->root.next = gesture;
+    indexGesture(gesture);
     gesture->firstPoint = event.point;
     gesture->firstPercentPoint = event.pointPercent;
     gesture->start = event.time;
+    if(!group->activeCount && !group->finishedCount || event.time < group->minStartTime)
+        group->minStartTime = event.time;
     addGesturePoint(gesture, event.point, event.pointPercent, 1);
     group->activeCount++;
     return gesture;
 }
 
 static int finishGesture(Gesture* gesture) {
+    unindexGesture(gesture);
     gesture->finished = true;
     gesture->parent->finishedCount++;
     return --gesture->parent->activeCount;
 }
 
 static void removeGesture(Gesture* gesture) {
-    for(Gesture* node = &gesture->parent->root; node->next; node = node->next) {
-        if(node->next == gesture) {
-            node->next = gesture->next;
-            free(gesture);
-            return;
-        }
+    GestureGroup* group = gesture->parent;
+    updateGroupSums(&group->sums, gesture->firstPoint, gesture->lastPoint, -1);
+    group->totalSqDistance -= gesture->flags.totalSqDistance;
+    if(!gesture->finished) {
+        unindexGesture(gesture);
+        group->activeCount--;
+    }
+    gesture->prev->next = gesture->next;
+    if(gesture->next)
+        gesture->next->prev = gesture->prev;
+    // only removing the earliest gesture requires looking at the others
+    if(gesture->start == group->minStartTime) {
+        group->minStartTime = -1;
+        for(Gesture* node = group->root.next; node; node = node->next)
+            if(node->start < group->minStartTime)
+                group->minStartTime = node->start;
     }
-    assert(0);
+    free(gesture);
 }
 
-static GestureGroup* findGroup(GestureGroupID id) {
-    for(GestureGroup* node = root.next; node; node  = node->next) {
-        if(node->id == id)
-            return node;
+RecognizerState* createRecognizerState(GestureContext* context) {
+    RecognizerState* state = calloc(1, sizeof(RecognizerState));
+    if(state)
+        state->context = context;
+    return state;
+}
+
+RecognizerState* setRecognizerState(RecognizerState* state) {
+    RecognizerState* old = recognizerState;
+    recognizerState = state ? state : &defaultRecognizerState;
+    return old;
+}
+
+void freeRecognizerState(RecognizerState* state) {
+    if(!state)
+        return;
+    RecognizerState* old = setRecognizerState(state);
+    // removing a group shifts later groups back so a slot is only advanced past once it is empty
+    for(uint32_t i = 0; i < state->groups.capacity; i++)
+        while(state->groups.values[i])
+            removeGroup(state->groups.values[i]);
+    free(state->groups.keys);
+    free(state->groups.values);
+    free(state->activeGestures.keys);
+    free(state->activeGestures.values);
+    setRecognizerState(old);
+    free(state);
+}
+
+GestureContext* getGestureContext() {
+    return recognizerState->context;
+}
+
+GestureContext* getDefaultGestureContext() {
+    return &defaultGestureContext;
+}
+
+GestureContext* createGestureContext() {
+    GestureContext* context = calloc(1, sizeof(GestureContext));
+    if(!context)
+        return NULL;
+    *context = (GestureContext) {.selectMask = DEFAULT_GESTURE_SELECT_MASK, .derivedMask = -1, .handler = dumpAndFreeGesture};
+    context->state = createRecognizerState(context);
+    if(!context->state) {
+        free(context);
+        return NULL;
     }
-    return NULL;
+    return context;
+}
+
+void freeGestureContext(GestureContext* context) {
+    assert(context != &defaultGestureContext);
+    freeRecognizerState(context->state);
+    free(context->stream);
+    free(context);
+}
+
+static GestureGroup* findGroup(GestureGroupID id) {
+    return getID(&recognizerState->groups, id);
 }
 static Gesture* findGesture(TouchID id) {
-    for(GestureGroup* group = root.next; group; group  = group->next)
-        for(Gesture* gesture = group->root.next; gesture; gesture = gesture->next)
-            if(gesture->id == id && !gesture->finished)
-                return gesture;
-    return NULL;
+    return getID(&recognizerState->activeGestures, id);
 }
 
 void enqueueEvent(GestureEvent* event);
+bool isGestureEventSelected(GestureMask mask);
 
 
 
@@ -217,12 +455,73 @@ GestureType getOppositeDirection(GestureType d) {
     return ((d - GESTURE_EAST + 4) % 8) + GESTURE_EAST ;
 }
 
-GestureType* transformGestureDetail(GestureDetail detail, TransformMasks mask) {
-    if(mask) {
-        for(int i = 0; i < getNumOfTypes(detail); i++)
-            detail[i] = getReflection(mask, getGestureType(detail, i));
+/// Non-direction types aren't changed by any transform
+#define NON_DIRECTION_TYPES GESTURE_NONE, GESTURE_UNKNOWN, GESTURE_PINCH, GESTURE_PINCH_OUT, GESTURE_TAP, GESTURE_TOO_LARGE, 6, 7
+/// Every type but GESTURE_NONE becomes GESTURE_UNKNOWN under a combination of masks that isn't a transform
+#define INVALID_TRANSFORM {GESTURE_NONE, GESTURE_UNKNOWN, GESTURE_UNKNOWN, GESTURE_UNKNOWN, GESTURE_UNKNOWN, GESTURE_UNKNOWN, \
+    GESTURE_UNKNOWN, GESTURE_UNKNOWN, GESTURE_UNKNOWN, GESTURE_UNKNOWN, GESTURE_UNKNOWN, GESTURE_UNKNOWN, GESTURE_UNKNOWN, \
+    GESTURE_UNKNOWN, GESTURE_UNKNOWN, GESTURE_UNKNOWN}
+const uint8_t gestureTransformTables[16][16] __attribute__((aligned(16))) = {
+    [TransformNone] = {NON_DIRECTION_TYPES, GESTURE_EAST, GESTURE_NORTH_EAST, GESTURE_NORTH, GESTURE_NORTH_WEST,
+        GESTURE_WEST, GESTURE_SOUTH_WEST, GESTURE_SOUTH, GESTURE_SOUTH_EAST},
+    [MirroredXMask] = {NON_DIRECTION_TYPES, GESTURE_WEST, GESTURE_NORTH_WEST, GESTURE_NORTH, GESTURE_NORTH_EAST,
+        GESTURE_EAST, GESTURE_SOUTH_EAST, GESTURE_SOUTH, GESTURE_SOUTH_WEST},
+    [MirroredYMask] = {NON_DIRECTION_TYPES, GESTURE_EAST, GESTURE_SOUTH_EAST, GESTURE_SOUTH, GESTURE_SOUTH_WEST,
+        GESTURE_WEST, GESTURE_NORTH_WEST, GESTURE_NORTH, GESTURE_NORTH_EAST},
+    [MirroredMask] = {NON_DIRECTION_TYPES, GESTURE_WEST, GESTURE_SOUTH_WEST, GESTURE_SOUTH, GESTURE_SOUTH_EAST,
+        GESTURE_EAST, GESTURE_NORTH_EAST, GESTURE_NORTH, GESTURE_NORTH_WEST},
+    [Rotate90Mask] = {NON_DIRECTION_TYPES, GESTURE_NORTH, GESTURE_NORTH_WEST, GESTURE_WEST, GESTURE_SOUTH_WEST,
+        GESTURE_SOUTH, GESTURE_SOUTH_EAST, GESTURE_EAST, GESTURE_NORTH_EAST},
+    [5] = INVALID_TRANSFORM, [6] = INVALID_TRANSFORM, [7] = INVALID_TRANSFORM,
+    [Rotate270Mask] = {NON_DIRECTION_TYPES, GESTURE_SOUTH, GESTURE_SOUTH_EAST, GESTURE_EAST, GESTURE_NORTH_EAST,
+        GESTURE_NORTH, GESTURE_NORTH_WEST, GESTURE_WEST, GESTURE_SOUTH_WEST},
+    [9] = INVALID_TRANSFORM, [10] = INVALID_TRANSFORM, [11] = INVALID_TRANSFORM, [12] = INVALID_TRANSFORM,
+    [13] = INVALID_TRANSFORM, [14] = INVALID_TRANSFORM, [15] = INVALID_TRANSFORM,
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+/**
+ * Looks up both nibbles of 16 packed bytes at a time with pshufb
+ */
+__attribute__((target("ssse3")))
+static void transformPackedTypesSSSE3(uint8_t* dest, const uint8_t* src, const uint8_t table[16]) {
+    const __m128i lookup = _mm_load_si128((const __m128i*)table);
+    const __m128i lowNibbles = _mm_set1_epi8(0x0F);
+    for(int i = 0; i < MAX_GESTURE_DETAIL_SIZE / 2; i += 16) {
+        __m128i packed = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i low = _mm_shuffle_epi8(lookup, _mm_and_si128(packed, lowNibbles));
+        __m128i high = _mm_shuffle_epi8(lookup, _mm_and_si128(_mm_srli_epi16(packed, 4), lowNibbles));
+        _mm_storeu_si128((__m128i*)(dest + i), _mm_or_si128(low, _mm_slli_epi16(high, 4)));
+    }
+}
+#endif
+
+static void transformPackedTypes(uint8_t* dest, const uint8_t* src, const uint8_t table[16]) {
+#if defined(__x86_64__) || defined(__i386__)
+    if(__builtin_cpu_supports("ssse3")) {
+        transformPackedTypesSSSE3(dest, src, table);
+        return;
     }
-    return detail;
+#endif
+    for(int i = 0; i < MAX_GESTURE_DETAIL_SIZE / 2; i++)
+        dest[i] = table[src[i] & 0xF] | table[src[i] >> 4] << 4;
+}
+
+GestureDetail* copyTransformedGestureDetail(GestureDetail* dest, const GestureDetail* src, TransformMasks mask) {
+    const uint8_t* table = gestureTransformTables[mask & 0xF];
+    transformPackedTypes(dest->packed, src->packed, table);
+    dest->size = src->size;
+    // read the nibbles directly; passing the detail by value for every type costs more than the transform
+    uint32_t hash = 0;
+    for(int i = 0; i < dest->size; i++)
+        hash += GESTURE_DETAIL_HASH_TERM(i, dest->packed[i / 2] >> (i % 2 * 4) & 0xF);
+    dest->hash = hash;
+    return dest;
+}
+
+GestureDetail* transformGestureDetail(GestureDetail* detail, TransformMasks mask) {
+    return mask ? copyTransformedGestureDetail(detail, detail, mask) : detail;
 }
 
 const char* getGestureMaskString(GestureMask mask) {
@@ -239,6 +538,12 @@ const char* getGestureMaskString(GestureMask mask) {
             return "TouchMotionMask";
         case TouchCancelMask:
             return "TouchCancelMask";
+        case GestureMatchMask:
+            return "GestureMatchMask";
+        case GestureNoMatchMask:
+            return "GestureNoMatchMask";
+        case GestureMotionMask:
+            return "GestureMotionMask";
     }
     return "UNKNOWN";
 }
@@ -276,16 +581,37 @@ const char* getGestureTypeString(GestureType t) {
     }
 }
 
+/**
+ * Sets firstSpread and lastSpread to the sum of the squared distances of the
+ * first and last points of group's gestures from their centroid
+ */
+static inline void getGroupSpreads(const GestureGroup* group, double* firstSpread, double* lastSpread) {
+    const GroupSums* sums = &group->sums;
+    double n = group->activeCount + group->finishedCount;
+    *firstSpread = sums->firstSq - ((double)sums->firstX * sums->firstX + (double)sums->firstY * sums->firstY) / n;
+    *lastSpread = sums->lastSq - ((double)sums->lastX * sums->lastX + (double)sums->lastY * sums->lastY) / n;
+}
+
+/**
+ * @return the sum of the squared distances from point of the n points whose
+ * coordinates sum to x, y and whose squared norms sum to sq
+ */
+static inline int64_t getSqDistanceSum(int64_t sq, int64_t x, int64_t y, int n, const GesturePoint point) {
+    return sq - 2 * (x * point.x + y * point.y) + n * ((int64_t)point.x * point.x + (int64_t)point.y * point.y);
+}
+
+/**
+ * Classifies group as a pinch if the average squared distance of its fingers
+ * to the finger farthest from their centroids changed by more than
+ * PINCH_THRESHOLD_PERCENT. Only choosing that finger visits the gestures; the
+ * distances come from the group's sums
+ */
 bool generatePinchEvent(GestureEvent* gestureEvent, GestureGroup* group) {
     if(gestureEvent->flags.fingers > 1) {
-        GesturePoint avgEnd = {0, 0};
-        GesturePoint avgStart = {0, 0};
-        for(Gesture* gesture = group->root.next; gesture; gesture = gesture->next) {
-            ADD_POINT(avgStart, gesture->firstPoint);
-            ADD_POINT(avgEnd, gesture->lastPoint);
-        }
-        DIVIDE_POINT(avgEnd, gestureEvent->flags.fingers);
-        DIVIDE_POINT(avgStart, gestureEvent->flags.fingers);
+        const GroupSums* sums = &group->sums;
+        int n = gestureEvent->flags.fingers;
+        GesturePoint avgStart = {sums->firstX / n, sums->firstY / n};
+        GesturePoint avgEnd = {sums->lastX / n, sums->lastY / n};
         Gesture* ref = NULL;
         double refDistance = -1;
         for(Gesture* gesture = group->root.next; gesture; gesture = gesture->next) {
@@ -296,92 +622,111 @@ bool generatePinchEvent(GestureEvent* gestureEvent, GestureGroup* group) {
             }
         }
         assert(ref);
-        double avgStartDis = 0;
-        double avgEndDis = 0;
-        for(Gesture* gesture = group->root.next; gesture; gesture = gesture->next) {
-            avgEndDis += SQ_DIST(gesture->lastPoint, ref->lastPoint);
-            avgStartDis += SQ_DIST(gesture->firstPoint, ref->firstPoint);
-        }
-        avgEndDis /= (gestureEvent->flags.fingers - 1);
-        avgStartDis /= (gestureEvent->flags.fingers - 1);
+        double avgStartDis = (double)getSqDistanceSum(sums->firstSq, sums->firstX, sums->firstY, n, ref->firstPoint) / (n - 1);
+        double avgEndDis = (double)getSqDistanceSum(sums->lastSq, sums->lastX, sums->lastY, n, ref->lastPoint) / (n - 1);
         double percentDiff = (avgStartDis - avgEndDis) * 2 / (avgStartDis + avgEndDis);
         if(percentDiff > PINCH_THRESHOLD_PERCENT)
-            setGestureType(gestureEvent->detail,  GESTURE_PINCH);
+            setGestureType(&gestureEvent->detail,  GESTURE_PINCH);
         else if(percentDiff < -PINCH_THRESHOLD_PERCENT)
-            setGestureType(gestureEvent->detail,  GESTURE_PINCH_OUT);
+            setGestureType(&gestureEvent->detail,  GESTURE_PINCH_OUT);
         else return 0;
         return 1;
     }
     return 0;
 }
 
+/**
+ * @return true if detail is exactly base transformed by mask
+ */
+static bool isTransformOf(const GestureDetail* detail, const GestureDetail* base, TransformMasks mask) {
+    GestureDetail transformed;
+    return areDetailsEqual(*detail, *copyTransformedGestureDetail(&transformed, base, mask));
+}
+
+/**
+ * Sets the event's detail if every gesture of group has the same detail or a
+ * single transform of the first gesture's detail. Details are compared by the
+ * hashes each gesture maintains and only compared exactly when hashes match
+ *
+ * @return 1 iff the detail was set
+ */
 bool setReflectionMask(GestureEvent* gestureEvent, GestureGroup* group) {
     Gesture* gesture = group->root.next;
     uint32_t sameCount = 0;
-    const TransformMasks reflectionMasks[] = {MirroredMask, MirroredXMask, MirroredYMask, Rotate90Mask};
-    uint32_t reflectionCounts[LEN(reflectionMasks)] = {0};
+    uint32_t reflectionCounts[LEN(gestureReflectionMasks)] = {0};
     for(Gesture* node = gesture; node; node = node->next)
         if(getNumOfTypes(node->info) != getNumOfTypes(gesture->info)) {
             break;
         }
-        else if(areDetailsEqual(node->info, gesture->info)) {
+        else if(node->info.hash == gesture->info.hash && areDetailsEqual(node->info, gesture->info)) {
             sameCount++;
         }
         else {
-            for(int i = 0; i < getNumOfTypes(gesture->info); i++) {
-                reflectionCounts[0] += getOppositeDirection(getGestureType(gesture->info, i)) == getGestureType(node->info, i);
-                reflectionCounts[1] += getMirroredXDirection(getGestureType(gesture->info, i)) == getGestureType(node->info, i);
-                reflectionCounts[2] += getMirroredYDirection(getGestureType(gesture->info, i)) == getGestureType(node->info, i);
-                reflectionCounts[3] += getRot90Direction(getGestureType(gesture->info, i)) == getGestureType(node->info, i) ||
-                    getRot270Direction(getGestureType(gesture->info, i)) == getGestureType(node->info, i);
-            }
+            for(uint32_t i = 0; i < LEN(gestureReflectionMasks); i++)
+                reflectionCounts[i] += node->info.hash == gesture->transformHashes[i] &&
+                    isTransformOf(&node->info, &gesture->info, gestureReflectionMasks[i]);
         }
     if(sameCount == gestureEvent->flags.fingers) {
-        memcpy(gestureEvent->detail, gesture->info, sizeof(GestureDetail));
+        gestureEvent->detail = gesture->info;
         return 1;
     }
-    for(uint32_t i = 0; i < LEN(reflectionMasks); i++) {
-        if(sameCount + reflectionCounts[i] / getNumOfTypes(gesture->info) == gestureEvent->flags.fingers) {
-            gestureEvent->flags.reflectionMask = reflectionMasks[i];
-            memcpy(gestureEvent->detail, gesture->info, sizeof(GestureDetail));
+    // gestures rotated either way count as rotated
+    reflectionCounts[LEN(gestureReflectionMasks) - 2] += reflectionCounts[LEN(gestureReflectionMasks) - 1];
+    for(uint32_t i = 0; i < LEN(gestureReflectionMasks) - 1; i++) {
+        if(sameCount + reflectionCounts[i] == gestureEvent->flags.fingers) {
+            gestureEvent->flags.reflectionMask = gestureReflectionMasks[i];
+            gestureEvent->detail = gesture->info;
             return 1;
         }
     }
     return 0;
 }
+
 void setFlags(Gesture* g, GestureEvent* event) {
-    g->flags.avgSqDisplacement = SQ_DIST(g->firstPoint, g->lastPoint);
-    g->flags.avgSqDistance = g->flags.totalSqDistance;
-    g->flags.duration = event->time - g->start;
     event->flags.totalSqDistance = g->flags.totalSqDistance;
-    event->flags.avgSqDisplacement  = g->flags.avgSqDisplacement;
-    event->flags.avgSqDistance = g->flags.avgSqDistance;
+    event->flags.avgSqDisplacement = SQ_DIST(g->firstPoint, g->lastPoint);
+    event->flags.avgSqDistance = g->flags.totalSqDistance;
     event->flags.duration = event->time - g->start;
 }
 
+/**
+ * Sets event's flags from the totals group maintains as points are added
+ */
 void combineFlags(GestureGroup* group, GestureEvent* event) {
-    uint32_t minStartTime = -1;
-    for(Gesture* gesture = group->root.next; gesture; gesture = gesture->next) {
-        event->flags.avgSqDisplacement += gesture->flags.avgSqDisplacement;
-        event->flags.avgSqDistance += gesture->flags.avgSqDistance;
-        event->flags.totalSqDistance += gesture->flags.totalSqDistance;
-        if(gesture->start < minStartTime)
-            minStartTime  = gesture->start;
-    }
-    event->flags.avgSqDisplacement /= event->flags.fingers;
-    event->flags.avgSqDistance /= event->flags.fingers;
-    event->flags.duration = event->time - minStartTime;
+    const GroupSums* sums = &group->sums;
+    // the sum of SQ_DIST(firstPoint, lastPoint) over every gesture
+    uint32_t sqDisplacement = sums->firstSq - 2 * sums->dot + sums->lastSq;
+    event->flags.avgSqDisplacement = sqDisplacement / event->flags.fingers;
+    event->flags.avgSqDistance = group->totalSqDistance / event->flags.fingers;
+    event->flags.totalSqDistance = group->totalSqDistance;
+    event->flags.duration = event->time - group->minStartTime;
+}
+
+/**
+ * Sets event's scale, rotation and centroid from the group's sums.
+ * Rotation and scale are those of the similarity transform that best maps the
+ * fingers' first points onto their last points
+ */
+static void setGroupMotion(GestureGroup* group, GestureEvent* event) {
+    const GroupSums* sums = &group->sums;
+    double n = group->activeCount + group->finishedCount;
+    event->centroid = (GesturePoint) {sums->lastX / n, sums->lastY / n};
+    double firstSpread, lastSpread;
+    getGroupSpreads(group, &firstSpread, &lastSpread);
+    double dot = sums->dot - ((double)sums->firstX * sums->lastX + (double)sums->firstY * sums->lastY) / n;
+    double cross = sums->cross - ((double)sums->firstX * sums->lastY - (double)sums->firstY * sums->lastX) / n;
+    event->scale = firstSpread > 0 ? sqrt(lastSpread / firstSpread) : 1;
+    event->rotation = atan2(cross, dot);
 }
 
-static uint32_t gestureEventSeqCounter;
 GestureEvent* generateGestureEvent(Gesture* g, uint32_t mask, uint32_t time) {
     assert(g);
     assert(g->parent);
     GestureGroup* group = g->parent;
     assert(group);
-    GestureEvent* gestureEvent = malloc(sizeof(GestureEvent));
+    GestureEvent* gestureEvent = borrowGestureEvent();
     *gestureEvent = (GestureEvent) {
-        .seq = ++gestureEventSeqCounter,
+        .seq = __atomic_add_fetch(&recognizerState->context->seqCounter, 1, __ATOMIC_RELAXED),
         .id = group->id,
         .lastEventId = g->id,
         .time = time,
@@ -394,24 +739,36 @@ GestureEvent* generateGestureEvent(Gesture* g, uint32_t mask, uint32_t time) {
             .fingers = group->activeCount + group->finishedCount
         }
     };
+    int derived = (mask & getGestureContext()->derivedMask) != 0;
+    if(derived && mask & (GestureMotionMask | GestureEndMask))
+        setGroupMotion(group, gestureEvent);
     if(mask == GestureEndMask) {
-        combineFlags(group, gestureEvent);
+        if(derived)
+            combineFlags(group, gestureEvent);
         if(setReflectionMask(gestureEvent, group)) {}
         else if(generatePinchEvent(gestureEvent, group)) {}
         else {
-            setGestureType(gestureEvent->detail, GESTURE_UNKNOWN);
+            setGestureType(&gestureEvent->detail, GESTURE_UNKNOWN);
         }
         return gestureEvent;
     }
-    else
+    else if(derived)
         setFlags(g, gestureEvent);
     if(g->numPoints == 1)
-        setGestureType(gestureEvent->detail, GESTURE_TAP);
+        setGestureType(&gestureEvent->detail, GESTURE_TAP);
     else
-        memcpy(gestureEvent->detail, g->info, sizeof(GestureDetail));
+        gestureEvent->detail = g->info;
     return gestureEvent;
 }
 
+/**
+ * Generates and enqueues an event for gesture unless nothing is listening for mask
+ */
+static inline void generateSelectedEvent(Gesture* gesture, GestureMask mask, uint32_t time) {
+    if(isGestureEventSelected(mask))
+        enqueueEvent(generateGestureEvent(gesture, mask, time));
+}
+
 void startGesture(const TouchEvent event, const char* sysName, const char* name) {
     GestureGroupID gestureGroupID = generateID(&event);
     GestureGroup* group = findGroup(gestureGroupID);
@@ -421,7 +778,41 @@ void startGesture(const TouchEvent event, const char* sysName, const char* name)
     assert(group == findGroup(gestureGroupID));
     Gesture* gesture = createGesture(group, event);
     assert(gesture == findGesture(generateTouchID(event.id, event.seat)));
-    enqueueEvent(generateGestureEvent(gesture, TouchStartMask, event.time));
+    generateSelectedEvent(gesture, TouchStartMask, event.time);
+}
+
+void listenForGesturePrefixesInContext(GestureContext* context, const GestureBindingRegistry* registry) {
+    context->prefixRegistry = registry;
+}
+void listenForGesturePrefixes(const GestureBindingRegistry* registry) {
+    listenForGesturePrefixesInContext(getGestureContext(), registry);
+}
+
+/**
+ * Advances gesture through the prefix trie by the types added since the last call
+ * and generates an event the first time a single detail or no detail can match it
+ */
+static void updateGesturePrefix(Gesture* gesture, uint32_t time) {
+    const GestureBindingRegistry* prefixRegistry = recognizerState->context->prefixRegistry;
+    if(!prefixRegistry || gesture->prefixResolved)
+        return;
+    for(; gesture->prefixSize < getNumOfTypes(gesture->info); gesture->prefixSize++)
+        gesture->prefixNode = advanceGesturePrefix(prefixRegistry, gesture->prefixNode, getGestureType(gesture->info, gesture->prefixSize));
+    if(gesture->prefixNode == NO_GESTURE_PREFIX) {
+        gesture->prefixResolved = true;
+        generateSelectedEvent(gesture, GestureNoMatchMask, time);
+    }
+    else {
+        const GestureBindingArg* match = getGesturePrefixMatch(prefixRegistry, gesture->prefixNode);
+        if(match) {
+            gesture->prefixResolved = true;
+            if(isGestureEventSelected(GestureMatchMask)) {
+                GestureEvent* event = generateGestureEvent(gesture, GestureMatchMask, time);
+                event->detail = match->detail;
+                enqueueEvent(event);
+            }
+        }
+    }
 }
 
 void continueGesture(const TouchEvent event) {
@@ -430,7 +821,12 @@ void continueGesture(const TouchEvent event) {
     if(gesture) {
         if(!gesture->truncated) {
             bool newGesturePoint = addGesturePoint(gesture, event.point, event.pointPercent, 0);
-            enqueueEvent(generateGestureEvent(gesture, newGesturePoint ? TouchMotionMask : TouchHoldMask, event.time));
+            generateSelectedEvent(gesture, newGesturePoint ? TouchMotionMask : TouchHoldMask, event.time);
+            if(newGesturePoint) {
+                updateGesturePrefix(gesture, event.time);
+                if(gesture->parent->activeCount > 1)
+                    generateSelectedEvent(gesture, GestureMotionMask, event.time);
+            }
         }
     }
 }
@@ -439,7 +835,7 @@ void cancelGesture(const TouchEvent event) {
     TouchID id = generateTouchID(event.id, event.seat);
     Gesture* gesture = findGesture(id);
     if(gesture) {
-        enqueueEvent(generateGestureEvent(gesture, TouchCancelMask, event.time));
+        generateSelectedEvent(gesture, TouchCancelMask, event.time);
         if(gesture->parent->activeCount == 1)
             removeGroup(gesture->parent);
         else
@@ -453,13 +849,34 @@ void endGesture(const TouchEvent event) {
     if(gesture) {
         assert(gesture->numPoints);
         if(gesture->numPoints == 1) {
-            gesture->info[0] = GESTURE_TAP;
+            assert(getNumOfTypes(gesture->info) == 0);
+            addGestureType(gesture, GESTURE_TAP);
         }
-        enqueueEvent(generateGestureEvent(gesture, TouchEndMask, event.time));
+        generateSelectedEvent(gesture, TouchEndMask, event.time);
         assert(gesture->parent->activeCount);
         if(finishGesture(gesture) == 0) {
-            enqueueEvent(generateGestureEvent(gesture, GestureEndMask, event.time));
+            generateSelectedEvent(gesture, GestureEndMask, event.time);
             removeGroup(gesture->parent);
         }
     }
 }
+
+/// Runs CALL with context's state as the calling thread's current state
+#define IN_CONTEXT(CONTEXT, CALL) do { \
+        RecognizerState* old = setRecognizerState((CONTEXT)->state); \
+        CALL; \
+        setRecognizerState(old); \
+    } while(0)
+
+void startGestureInContext(GestureContext* context, const TouchEvent event, const char* sysName, const char* name) {
+    IN_CONTEXT(context, startGesture(event, sysName, name));
+}
+void continueGestureInContext(GestureContext* context, const TouchEvent event) {
+    IN_CONTEXT(context, continueGesture(event));
+}
+void endGestureInContext(GestureContext* context, const TouchEvent event) {
+    IN_CONTEXT(context, endGesture(event));
+}
+void cancelGestureInContext(GestureContext* context, const TouchEvent event) {
+    IN_CONTEXT(context, cancelGesture(event));
+}
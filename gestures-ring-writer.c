@@ -0,0 +1,122 @@
+/**
+ * @file
+ *
+ * Publishes TouchRecords to a TouchRing read by gestures-ring.c
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ring.h"
+#include "touch.h"
+
+int createTouchRing(TouchRingWriter* writer, const char* path, uint32_t capacity) {
+    *writer = (TouchRingWriter) {.memFd = -1, .listenFd = -1, .path = path};
+    size_t size = getTouchRingSize(capacity);
+    writer->memFd = memfd_create("sgestures-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(writer->memFd == -1 || ftruncate(writer->memFd, size) == -1 || fcntl(writer->memFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == -1)
+        goto error;
+    writer->ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, writer->memFd, 0);
+    if(writer->ring == MAP_FAILED) {
+        writer->ring = NULL;
+        goto error;
+    }
+    writer->ring->magic = TOUCH_RING_MAGIC;
+    writer->ring->capacity = capacity;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    writer->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(writer->listenFd == -1 || bind(writer->listenFd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(writer->listenFd, MAX_TOUCH_RING_READERS) == -1)
+        goto error;
+    return 0;
+error:
+    if(writer->ring)
+        munmap(writer->ring, size);
+    if(writer->memFd != -1)
+        close(writer->memFd);
+    if(writer->listenFd != -1)
+        close(writer->listenFd);
+    return -1;
+}
+
+int acceptTouchRingReader(TouchRingWriter* writer) {
+    int sock = accept4(writer->listenFd, NULL, NULL, SOCK_CLOEXEC);
+    if(sock == -1)
+        return -1;
+    int fds[2] = {writer->memFd, eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)};
+    if(writer->numReaders == MAX_TOUCH_RING_READERS || fds[1] == -1) {
+        if(fds[1] != -1)
+            close(fds[1]);
+        close(sock);
+        return -1;
+    }
+    uint64_t seq = writer->ring->writeSeq;
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec iov = {&seq, sizeof(seq)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if(sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(seq)) {
+        close(fds[1]);
+        close(sock);
+        return -1;
+    }
+    writer->readers[writer->numReaders].socket = sock;
+    writer->readers[writer->numReaders++].eventFd = fds[1];
+    return 0;
+}
+
+void removeTouchRingReader(TouchRingWriter* writer, uint32_t i) {
+    close(writer->readers[i].socket);
+    close(writer->readers[i].eventFd);
+    writer->readers[i] = writer->readers[--writer->numReaders];
+}
+
+void setTouchRingDevice(TouchRingWriter* writer, const DeviceRecord* record) {
+    writer->ring->devices[record->device] = *record;
+}
+
+void publishTouchRecord(TouchRingWriter* writer, const TouchRecord* record) {
+    TouchRing* ring = writer->ring;
+    uint64_t seq = ring->writeSeq;
+    TouchRingSlot* slot = &ring->slots[seq & (ring->capacity - 1)];
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->record = *record;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->writeSeq, seq + 1, __ATOMIC_RELEASE);
+    writer->pending = 1;
+}
+
+void notifyTouchRingReaders(TouchRingWriter* writer) {
+    if(!writer->pending)
+        return;
+    uint64_t one = 1;
+    for(uint32_t i = 0; i < writer->numReaders; i++)
+        // a full counter means the reader already has a wakeup pending
+        if(write(writer->readers[i].eventFd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            removeTouchRingReader(writer, i--);
+    writer->pending = 0;
+}
+
+void closeTouchRing(TouchRingWriter* writer) {
+    __atomic_store_n(&writer->ring->closed, 1, __ATOMIC_RELEASE);
+    writer->pending = 1;
+    notifyTouchRingReaders(writer);
+    while(writer->numReaders)
+        removeTouchRingReader(writer, 0);
+    munmap(writer->ring, getTouchRingSize(writer->ring->capacity));
+    close(writer->memFd);
+    close(writer->listenFd);
+    unlink(writer->path);
+}
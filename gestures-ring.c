@@ -0,0 +1,157 @@
+/**
+ * @file
+ *
+ * Reads TouchRecords from a TouchRing published by gestures-libinput-writer
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ring.h"
+#include "touch.h"
+
+struct TouchRingReader {
+    const TouchRing* ring;
+    size_t size;
+    /// ring->capacity as validated when attaching; the shared copy is never trusted again
+    uint32_t capacity;
+    int socket;
+    int eventFd;
+    /// sequence number of the next record to process
+    uint64_t readSeq;
+    uint64_t lostRecords;
+};
+
+/**
+ * Receives the memfd and eventfd sent by the writer along with the sequence
+ * number of the first record to read
+ */
+static int receiveRing(int socket, int fds[2], uint64_t* startSeq) {
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    struct iovec iov = {startSeq, sizeof(*startSeq)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    int ret;
+    while((ret = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if(ret != sizeof(*startSeq) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 2))
+        return -1;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 2);
+    return 0;
+}
+
+TouchRingReader* attachTouchRing(const char* path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int fds[2];
+    uint64_t startSeq;
+    if(sock == -1 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 || receiveRing(sock, fds, &startSeq) == -1) {
+        if(sock != -1)
+            close(sock);
+        return NULL;
+    }
+    struct stat st;
+    const TouchRing* ring = fstat(fds[0], &st) == -1 ? MAP_FAILED : mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    uint32_t capacity = ring == MAP_FAILED ? 0 : ring->capacity;
+    // the index mask is capacity - 1 so it has to be a power of 2
+    bool valid = capacity && !(capacity & (capacity - 1)) && ring->magic == TOUCH_RING_MAGIC &&
+        getTouchRingSize(capacity) <= (size_t)st.st_size;
+    TouchRingReader* reader = valid ? malloc(sizeof(TouchRingReader)) : NULL;
+    if(!reader) {
+        if(ring != MAP_FAILED)
+            munmap((void*)ring, st.st_size);
+        close(fds[1]);
+        close(sock);
+        return NULL;
+    }
+    *reader = (TouchRingReader) {ring, st.st_size, capacity, sock, fds[1], startSeq};
+    return reader;
+}
+
+int getTouchRingFd(const TouchRingReader* reader) {
+    return reader->eventFd;
+}
+
+uint64_t getTouchRingLostRecords(const TouchRingReader* reader) {
+    return reader->lostRecords;
+}
+
+/**
+ * Processes every record published but not yet read.
+ * Slots are checked before and after being copied so a record being
+ * overwritten by the writer is detected and counted as lost. If the writer is
+ * still overwriting the next slot, processing stops until it signals the
+ * eventfd instead of spinning on the slot
+ *
+ * @return the number of records processed
+ */
+static int processTouchRing(TouchRingReader* reader) {
+    const TouchRing* ring = reader->ring;
+    const uint32_t capacity = reader->capacity;
+    int count = 0;
+    uint64_t writeSeq;
+    while(reader->readSeq < (writeSeq = __atomic_load_n(&ring->writeSeq, __ATOMIC_ACQUIRE))) {
+        if(writeSeq - reader->readSeq > capacity) {
+            reader->lostRecords += writeSeq - capacity - reader->readSeq;
+            reader->readSeq = writeSeq - capacity;
+        }
+        for(; reader->readSeq < writeSeq; reader->readSeq++) {
+            const TouchRingSlot* slot = &ring->slots[reader->readSeq & (capacity - 1)];
+            uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            TouchRecord record = slot->record;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(seq != reader->readSeq + 1 || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+                // once the overwrite is complete writeSeq shows the lap and the outer loop skips the lost records
+                if(__atomic_load_n(&ring->writeSeq, __ATOMIC_ACQUIRE) - reader->readSeq <= capacity)
+                    return count;
+                break;
+            }
+            const DeviceRecord* device = &ring->devices[record.device];
+            if(processTouchRecord(&record, device->sysName, device->name) == 1)
+                count++;
+        }
+    }
+    return count;
+}
+
+int readTouchRing(TouchRingReader* reader) {
+    while(true) {
+        int count = processTouchRing(reader);
+        if(count)
+            return count;
+        if(__atomic_load_n(&reader->ring->closed, __ATOMIC_ACQUIRE))
+            return processTouchRing(reader);
+        struct pollfd pfd = {reader->eventFd, POLLIN};
+        if(poll(&pfd, 1, -1) == -1 && errno != EINTR)
+            return -1;
+        uint64_t counter;
+        if(read(reader->eventFd, &counter, sizeof(counter)) == -1 && errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+}
+
+TouchReadStatus processPendingTouchRing(TouchRingReader* reader) {
+    // the counter is reset first so records published from now on make the fd readable again
+    uint64_t counter;
+    if(read(reader->eventFd, &counter, sizeof(counter)) == -1 && errno != EAGAIN && errno != EINTR)
+        return TOUCH_READ_ERROR;
+    // everything published before the ring was closed is processed below
+    bool closed = __atomic_load_n(&reader->ring->closed, __ATOMIC_ACQUIRE);
+    processTouchRing(reader);
+    return closed ? TOUCH_READ_EOF : TOUCH_READ_AGAIN;
+}
+
+void detachTouchRing(TouchRingReader* reader) {
+    munmap((void*)reader->ring, reader->size);
+    close(reader->eventFd);
+    close(reader->socket);
+    free(reader);
+}
@@ -0,0 +1,171 @@
+/**
+ * @file
+ *
+ * Splits touch processing across threads by device. Every device is assigned
+ * a shard the first time one of its records is seen and all of its records
+ * are applied, in order, to that shard's RecognizerState by the shard's thread
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gestures-private.h"
+#include "touch.h"
+
+#define SHARD_QUEUE_SIZE (1 << 10)
+/// Max number of devices remembered by the device to shard table
+#define MAX_SHARDED_DEVICES 256
+
+typedef struct {
+    TouchRecord record;
+    /// names of the record's device; only set for TouchStartMask
+    char sysName[DEVICE_NAME_LEN];
+    char name[DEVICE_NAME_LEN];
+} ShardRecord;
+
+/**
+ * A RecognizerState and the thread that owns it.
+ * Records are passed from the thread calling processTouchRecord through a
+ * single producer single consumer queue like the handler thread's
+ */
+typedef struct {
+    ShardRecord records[SHARD_QUEUE_SIZE];
+    /// next index to read from; only modified by the shard's thread
+    uint32_t readIndex __attribute__((aligned(64)));
+    /// next index to write to; only modified by the producer
+    uint32_t writeIndex __attribute__((aligned(64)));
+    /// posted once per queued record and once more to stop
+    sem_t pending;
+    pthread_t thread;
+    RecognizerState* state;
+} GestureShard;
+
+static struct {
+    GestureShard* shards;
+    uint32_t numShards;
+    /// shard given to the next new device
+    uint32_t nextShard;
+    /// the context whose records are sharded or NULL if the shards aren't running
+    GestureContext* context;
+    /// open addressed ProductID to shard table; only used by the producer
+    struct {
+        ProductID id;
+        uint32_t shard;
+        bool used;
+    } devices[MAX_SHARDED_DEVICES];
+} gestureShards;
+
+bool areGestureShardsRunning() {
+    return __atomic_load_n(&gestureShards.context, __ATOMIC_RELAXED) == getGestureContext();
+}
+
+/**
+ * @return the shard of device, assigning one if device hasn't been seen before
+ */
+static GestureShard* getShard(ProductID device) {
+    uint32_t start = device * 0x9E3779B1u % MAX_SHARDED_DEVICES;
+    for(uint32_t n = 0; n < MAX_SHARDED_DEVICES; n++) {
+        uint32_t i = (start + n) % MAX_SHARDED_DEVICES;
+        if(gestureShards.devices[i].used && gestureShards.devices[i].id == device)
+            return &gestureShards.shards[gestureShards.devices[i].shard];
+        if(!gestureShards.devices[i].used) {
+            // new devices get a shard of their own until every shard has one
+            uint32_t shard = gestureShards.nextShard++ % gestureShards.numShards;
+            gestureShards.devices[i].id = device;
+            gestureShards.devices[i].shard = shard;
+            gestureShards.devices[i].used = 1;
+            return &gestureShards.shards[shard];
+        }
+    }
+    return &gestureShards.shards[device % gestureShards.numShards];
+}
+
+void routeTouchRecord(const TouchRecord* record, const char* sysName, const char* name) {
+    GestureShard* shard = getShard(record->touchEvent.id);
+    // records can't be dropped without corrupting the state of their touch so wait for room
+    while(shard->writeIndex - __atomic_load_n(&shard->readIndex, __ATOMIC_ACQUIRE) == SHARD_QUEUE_SIZE)
+        sched_yield();
+    ShardRecord* dest = &shard->records[shard->writeIndex % SHARD_QUEUE_SIZE];
+    dest->record = *record;
+    if(record->type == TouchStartMask) {
+        strncpy(dest->sysName, sysName, DEVICE_NAME_LEN - 1);
+        strncpy(dest->name, name, DEVICE_NAME_LEN - 1);
+        dest->sysName[DEVICE_NAME_LEN - 1] = 0;
+        dest->name[DEVICE_NAME_LEN - 1] = 0;
+    }
+    __atomic_store_n(&shard->writeIndex, shard->writeIndex + 1, __ATOMIC_RELEASE);
+    sem_post(&shard->pending);
+}
+
+static void* processShardRecords(void* arg) {
+    GestureShard* shard = arg;
+    setRecognizerState(shard->state);
+    while(1) {
+        while(sem_wait(&shard->pending) == -1 && errno == EINTR);
+        uint32_t index = shard->readIndex;
+        if(index == __atomic_load_n(&shard->writeIndex, __ATOMIC_ACQUIRE))
+            break;
+        const ShardRecord* record = &shard->records[index % SHARD_QUEUE_SIZE];
+        handleTouchRecord(&record->record, record->sysName, record->name);
+        __atomic_store_n(&shard->readIndex, index + 1, __ATOMIC_RELEASE);
+    }
+    setRecognizerState(NULL);
+    return NULL;
+}
+
+/**
+ * Stops and frees the first num shards
+ */
+static void stopShards(uint32_t num) {
+    for(uint32_t i = 0; i < num; i++) {
+        // the thread handles everything still queued before seeing the empty queue
+        sem_post(&gestureShards.shards[i].pending);
+        pthread_join(gestureShards.shards[i].thread, NULL);
+        sem_destroy(&gestureShards.shards[i].pending);
+        freeRecognizerState(gestureShards.shards[i].state);
+    }
+    free(gestureShards.shards);
+    __atomic_store_n(&gestureShards.context, NULL, __ATOMIC_RELAXED);
+    memset(&gestureShards, 0, sizeof(gestureShards));
+    setMultipleEventProducers(0);
+}
+
+int startGestureShards(uint32_t maxShards) {
+    if(gestureShards.context)
+        return gestureShards.context == getGestureContext() ? 0 : -1;
+    if(!maxShards)
+        return -1;
+    GestureShard* shards;
+    if(posix_memalign((void**)&shards, 64, sizeof(GestureShard) * maxShards))
+        return -1;
+    memset(shards, 0, sizeof(GestureShard) * maxShards);
+    gestureShards.shards = shards;
+    gestureShards.numShards = maxShards;
+    setMultipleEventProducers(1);
+    for(uint32_t i = 0; i < maxShards; i++) {
+        shards[i].state = createRecognizerState(getGestureContext());
+        if(!shards[i].state || sem_init(&shards[i].pending, 0, 0) == -1) {
+            freeRecognizerState(shards[i].state);
+            stopShards(i);
+            return -1;
+        }
+        if(pthread_create(&shards[i].thread, NULL, processShardRecords, &shards[i])) {
+            sem_destroy(&shards[i].pending);
+            freeRecognizerState(shards[i].state);
+            stopShards(i);
+            return -1;
+        }
+    }
+    __atomic_store_n(&gestureShards.context, getGestureContext(), __ATOMIC_RELAXED);
+    return 0;
+}
+
+void stopGestureShards() {
+    if(gestureShards.context != getGestureContext())
+        return;
+    stopShards(gestureShards.numShards);
+}
@@ -0,0 +1,204 @@
+/**
+ * @file
+ *
+ * Always on counters of the events given to the handler.
+ * Counters are only ever updated with relaxed atomic adds so they can be read
+ * from any thread or a signal handler at any time
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "gestures-private.h"
+
+static GestureStats stats;
+/// 1 + the id of the device counted in the same slot of stats.devices; 0 for an unused slot
+static uint64_t deviceKeys[MAX_GESTURE_STATS_DEVICES];
+
+uint64_t getMonotonicTimeNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @return the histogram bucket of value; bucket i holds values in [2^(i-1), 2^i)
+ */
+static inline uint32_t getBucket(uint64_t value) {
+    uint32_t bucket = value ? 64 - __builtin_clzll(value) : 0;
+    return MIN(bucket, GESTURE_STATS_BUCKETS - 1);
+}
+
+static inline void increment(uint64_t* counter) {
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Counts an event of device, claiming a slot for device the first time it is seen
+ */
+static void countDeviceEvent(ProductID device) {
+    uint32_t start = device * 0x9E3779B1u % MAX_GESTURE_STATS_DEVICES;
+    for(uint32_t n = 0; n < MAX_GESTURE_STATS_DEVICES; n++) {
+        uint32_t i = (start + n) % MAX_GESTURE_STATS_DEVICES;
+        uint64_t key = __atomic_load_n(&deviceKeys[i], __ATOMIC_ACQUIRE);
+        if(!key) {
+            uint64_t expected = 0;
+            if(__atomic_compare_exchange_n(&deviceKeys[i], &expected, device + 1ULL, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&stats.devices[i].id, device, __ATOMIC_RELAXED);
+                key = device + 1ULL;
+            }
+            else
+                key = expected;
+        }
+        if(key == device + 1ULL) {
+            increment(&stats.devices[i].events);
+            return;
+        }
+    }
+    increment(&stats.otherDevices);
+}
+
+void recordHandledGestureEvent(GestureMask mask, ProductID device, uint32_t time, uint64_t handlerStart, uint64_t handlerEnd) {
+    if(mask)
+        increment(&stats.events[__builtin_ctz(mask)]);
+    countDeviceEvent(device);
+    // TouchEvent times are CLOCK_MONOTONIC ms as reported by libinput
+    uint32_t latency = (uint32_t)(handlerEnd / 1000000) - time;
+    increment(&stats.latency[getBucket(latency)]);
+    increment(&stats.handlerTime[getBucket(handlerEnd - handlerStart)]);
+}
+
+void recordUnselectedGestureEvent() {
+    increment(&stats.unselected);
+}
+
+void recordDroppedGestureEvent() {
+    increment(&stats.dropped);
+}
+
+void recordGestureEventAllocation() {
+    increment(&stats.allocations);
+}
+
+GestureStats getGestureStats() {
+    GestureStats copy;
+    const uint64_t* src = (const uint64_t*)&stats;
+    uint64_t* dest = (uint64_t*)&copy;
+    _Static_assert(sizeof(GestureStats) % sizeof(uint64_t) == 0, "GestureStats must only hold uint64_t counters");
+    for(size_t i = 0; i < sizeof(GestureStats) / sizeof(uint64_t); i++)
+        dest[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    return copy;
+}
+
+/*
+ * The dump is formatted by hand into a buffer on the stack so that it only
+ * uses async-signal-safe functions
+ */
+
+static void flushBuffer(int fd, const char* buffer, uint32_t size) {
+    while(size) {
+        ssize_t ret = write(fd, buffer, size);
+        if(ret == -1 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return;
+        buffer += ret;
+        size -= ret;
+    }
+}
+
+/**
+ * Appends str to buffer[*size] flushing to fd when buffer is full
+ */
+static void appendString(int fd, char* buffer, uint32_t* size, uint32_t capacity, const char* str) {
+    for(; *str; str++) {
+        if(*size == capacity) {
+            flushBuffer(fd, buffer, *size);
+            *size = 0;
+        }
+        buffer[(*size)++] = *str;
+    }
+}
+
+static void appendNumber(int fd, char* buffer, uint32_t* size, uint32_t capacity, uint64_t value) {
+    char digits[21];
+    int i = sizeof(digits) - 1;
+    digits[i] = 0;
+    do
+        digits[--i] = '0' + value % 10;
+    while(value /= 10);
+    appendString(fd, buffer, size, capacity, digits + i);
+}
+
+#define APPEND(STR) appendString(fd, buffer, &size, sizeof(buffer), STR)
+#define APPEND_NUMBER(N) appendNumber(fd, buffer, &size, sizeof(buffer), N)
+
+static void appendHistogram(int fd, char* buffer, uint32_t* sizePtr, const char* name, const uint64_t* histogram) {
+    uint32_t size = *sizePtr;
+    for(uint32_t i = 0; i < GESTURE_STATS_BUCKETS; i++) {
+        uint64_t count = __atomic_load_n(&histogram[i], __ATOMIC_RELAXED);
+        if(!count)
+            continue;
+        APPEND(name);
+        APPEND(" <");
+        APPEND_NUMBER(1ULL << i);
+        APPEND(" ");
+        APPEND_NUMBER(count);
+        APPEND("\n");
+    }
+    *sizePtr = size;
+}
+
+void dumpGestureStats(int fd) {
+    char buffer[512];
+    uint32_t size = 0;
+    for(uint32_t i = 0; i < LEN(stats.events); i++) {
+        uint64_t count = __atomic_load_n(&stats.events[i], __ATOMIC_RELAXED);
+        if(!count)
+            continue;
+        APPEND("events ");
+        APPEND(getGestureMaskString(1 << i));
+        APPEND(" ");
+        APPEND_NUMBER(count);
+        APPEND("\n");
+    }
+    for(uint32_t i = 0; i < MAX_GESTURE_STATS_DEVICES; i++) {
+        if(!__atomic_load_n(&deviceKeys[i], __ATOMIC_ACQUIRE))
+            continue;
+        APPEND("device ");
+        APPEND_NUMBER(__atomic_load_n(&stats.devices[i].id, __ATOMIC_RELAXED));
+        APPEND(" ");
+        APPEND_NUMBER(__atomic_load_n(&stats.devices[i].events, __ATOMIC_RELAXED));
+        APPEND("\n");
+    }
+    APPEND("other_devices ");
+    APPEND_NUMBER(__atomic_load_n(&stats.otherDevices, __ATOMIC_RELAXED));
+    APPEND("\nunselected ");
+    APPEND_NUMBER(__atomic_load_n(&stats.unselected, __ATOMIC_RELAXED));
+    APPEND("\ndropped ");
+    APPEND_NUMBER(__atomic_load_n(&stats.dropped, __ATOMIC_RELAXED));
+    APPEND("\nallocations ");
+    APPEND_NUMBER(__atomic_load_n(&stats.allocations, __ATOMIC_RELAXED));
+    APPEND("\n");
+    appendHistogram(fd, buffer, &size, "latency_ms", stats.latency);
+    appendHistogram(fd, buffer, &size, "handler_ns", stats.handlerTime);
+    flushBuffer(fd, buffer, size);
+}
+
+static int statsFd;
+static void dumpGestureStatsHandler(int sig __attribute__((unused))) {
+    int savedErrno = errno;
+    dumpGestureStats(statsFd);
+    errno = savedErrno;
+}
+
+int dumpGestureStatsOnSignal(int sig, int fd) {
+    statsFd = fd;
+    struct sigaction action = {.sa_handler = dumpGestureStatsHandler, .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+    return sigaction(sig, &action, NULL);
+}
@@ -0,0 +1,155 @@
+/**
+ * @file
+ *
+ * Classification of whole strokes at once
+ */
+#include <stdint.h>
+
+#include "gestures-private.h"
+#include "gestures.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_LINE_TYPES
+#endif
+
+GestureType getLineType(const GesturePoint start, const GesturePoint end);
+
+/// Max number of lines classified at a time by segmentStroke
+#define STROKE_BLOCK_SIZE 64
+
+static inline uint32_t getSqDistance(GesturePoint start, GesturePoint end) {
+    uint32_t dx = (uint32_t)end.x - start.x, dy = (uint32_t)end.y - start.y;
+    return dx * dx + dy * dy;
+}
+
+static void getLineTypesScalar(const GesturePoint* points, uint32_t num, GestureType* types, uint32_t* sqDistances) {
+    for(uint32_t i = 1; i < num; i++) {
+        types[i - 1] = getLineType(points[i - 1], points[i]);
+        if(sqDistances)
+            sqDistances[i - 1] = getSqDistance(points[i - 1], points[i]);
+    }
+}
+
+#ifdef HAVE_X86_LINE_TYPES
+/**
+ * The type of a line indexed by 4 bits: x is significant, dx > 0, y is significant, dy > 0
+ * @see getLineType
+ */
+static const GestureType lineTypeTable[16] = {
+    [0x0] = GESTURE_NORTH_WEST,
+    [0x1] = GESTURE_WEST, [0x3] = GESTURE_EAST,
+    [0x4] = GESTURE_NORTH, [0xC] = GESTURE_SOUTH,
+    [0x5] = GESTURE_NORTH_WEST, [0x7] = GESTURE_NORTH_EAST,
+    [0xD] = GESTURE_SOUTH_WEST, [0xF] = GESTURE_SOUTH_EAST,
+};
+
+static inline GestureType getLineTypeFromMasks(int x, int y, int xPos, int yPos, int n) {
+    return lineTypeTable[(x >> n & 1) | (xPos >> (2 * n) & 1) << 1 | (y >> n & 1) << 2 | (yPos >> (2 * n + 1) & 1) << 3];
+}
+
+/*
+ * Each 64 bit lane holds the dx, dy of one line. A component is significant
+ * when 3 * d^2 > other^2 as unsigned 64 bit values (@see getLineType); there
+ * is no unsigned compare so the sign bits are flipped first.
+ * The squared distance is the low 32 bits of each lane of dx^2 + dy^2
+ */
+
+__attribute__((target("avx2")))
+static uint32_t getLineTypesAVX2(const GesturePoint* points, uint32_t num, GestureType* types, uint32_t* sqDistances) {
+    const __m256i signBit = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i lowHalves = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    uint32_t i = 0;
+    for(; i + 4 < num; i += 4) {
+        __m256i diff = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(points + i + 1)), _mm256_loadu_si256((const __m256i*)(points + i)));
+        __m256i dySwapped = _mm256_srli_epi64(diff, 32);
+        __m256i dx2 = _mm256_mul_epi32(diff, diff);
+        __m256i dy2 = _mm256_mul_epi32(dySwapped, dySwapped);
+        __m256i dx2x3 = _mm256_add_epi64(dx2, _mm256_add_epi64(dx2, dx2));
+        __m256i dy2x3 = _mm256_add_epi64(dy2, _mm256_add_epi64(dy2, dy2));
+        __m256i xBits = _mm256_cmpgt_epi64(_mm256_xor_si256(dx2x3, signBit), _mm256_xor_si256(dy2, signBit));
+        __m256i yBits = _mm256_cmpgt_epi64(_mm256_xor_si256(dy2x3, signBit), _mm256_xor_si256(dx2, signBit));
+        __m256i pos = _mm256_cmpgt_epi32(diff, _mm256_setzero_si256());
+        int x = _mm256_movemask_pd(_mm256_castsi256_pd(xBits));
+        int y = _mm256_movemask_pd(_mm256_castsi256_pd(yBits));
+        int xPos = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(pos, xBits)));
+        int yPos = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(pos, yBits)));
+        for(int n = 0; n < 4; n++)
+            types[i + n] = getLineTypeFromMasks(x, y, xPos, yPos, n);
+        if(sqDistances) {
+            __m256i sqSum = _mm256_permutevar8x32_epi32(_mm256_add_epi64(dx2, dy2), lowHalves);
+            _mm_storeu_si128((__m128i*)(sqDistances + i), _mm256_castsi256_si128(sqSum));
+        }
+    }
+    return i;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t getLineTypesSSE(const GesturePoint* points, uint32_t num, GestureType* types, uint32_t* sqDistances) {
+    const __m128i signBit = _mm_set1_epi64x(INT64_MIN);
+    uint32_t i = 0;
+    for(; i + 2 < num; i += 2) {
+        __m128i diff = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(points + i + 1)), _mm_loadu_si128((const __m128i*)(points + i)));
+        __m128i dySwapped = _mm_srli_epi64(diff, 32);
+        __m128i dx2 = _mm_mul_epi32(diff, diff);
+        __m128i dy2 = _mm_mul_epi32(dySwapped, dySwapped);
+        __m128i dx2x3 = _mm_add_epi64(dx2, _mm_add_epi64(dx2, dx2));
+        __m128i dy2x3 = _mm_add_epi64(dy2, _mm_add_epi64(dy2, dy2));
+        __m128i xBits = _mm_cmpgt_epi64(_mm_xor_si128(dx2x3, signBit), _mm_xor_si128(dy2, signBit));
+        __m128i yBits = _mm_cmpgt_epi64(_mm_xor_si128(dy2x3, signBit), _mm_xor_si128(dx2, signBit));
+        __m128i pos = _mm_cmpgt_epi32(diff, _mm_setzero_si128());
+        int x = _mm_movemask_pd(_mm_castsi128_pd(xBits));
+        int y = _mm_movemask_pd(_mm_castsi128_pd(yBits));
+        int xPos = _mm_movemask_ps(_mm_castsi128_ps(_mm_and_si128(pos, xBits)));
+        int yPos = _mm_movemask_ps(_mm_castsi128_ps(_mm_and_si128(pos, yBits)));
+        for(int n = 0; n < 2; n++)
+            types[i + n] = getLineTypeFromMasks(x, y, xPos, yPos, n);
+        if(sqDistances)
+            _mm_storel_epi64((__m128i*)(sqDistances + i), _mm_shuffle_epi32(_mm_add_epi64(dx2, dy2), _MM_SHUFFLE(3, 3, 2, 0)));
+    }
+    return i;
+}
+#endif
+
+void getLineTypes(const GesturePoint* points, uint32_t num, GestureType* types, uint32_t* sqDistances) {
+    uint32_t done = 0;
+#ifdef HAVE_X86_LINE_TYPES
+    if(__builtin_cpu_supports("avx2"))
+        done = getLineTypesAVX2(points, num, types, sqDistances);
+    else if(__builtin_cpu_supports("sse4.2"))
+        done = getLineTypesSSE(points, num, types, sqDistances);
+#endif
+    getLineTypesScalar(points + done, num - done, types + done, sqDistances ? sqDistances + done : NULL);
+}
+
+uint32_t segmentStroke(const GesturePoint* points, uint32_t num, GestureDetail* detail, uint32_t* totalSqDistance) {
+    if(!num)
+        return 0;
+    GestureType types[STROKE_BLOCK_SIZE];
+    uint32_t sqDistances[STROKE_BLOCK_SIZE];
+    StrokeState state = {0};
+    uint32_t last = 0, accepted = 1;
+    for(uint32_t block = 0; block + 1 < num; block += STROKE_BLOCK_SIZE) {
+        uint32_t blockSize = MIN(STROKE_BLOCK_SIZE, num - 1 - block);
+        getLineTypes(points + block, blockSize + 1, types, sqDistances);
+        for(uint32_t n = 0; n < blockSize; n++) {
+            uint32_t i = block + n + 1;
+            // lines not starting at the last accepted point have to be recomputed
+            bool precomputed = last == i - 1;
+            uint32_t distance = precomputed ? sqDistances[n] : getSqDistance(points[last], points[i]);
+            if(distance < THRESHOLD_SQ)
+                continue;
+            *totalSqDistance += distance;
+            GestureType dir = advanceStroke(&state, precomputed ? types[n] : getLineType(points[last], points[i]));
+            last = i;
+            accepted++;
+            if(dir != GESTURE_NONE) {
+                // like a touch, a stroke is truncated once its detail is full
+                if(!appendGestureType(detail, dir))
+                    return accepted;
+                commitStrokeDirection(&state, dir);
+            }
+        }
+    }
+    return accepted;
+}
@@ -34,12 +34,23 @@ typedef enum {
     Rotate270Mask = 8,
 
 } TransformMasks ;
+/// The events generated until listenForGestureEvents is called; every kind but GestureMotionMask
+#define DEFAULT_GESTURE_SELECT_MASK ((uint32_t)~GestureMotionMask)
 /**
  * Only Gesture with mask contained by mask will able to trigger events
- * By default all gestures are considered
+ * By default all gestures but GestureMotionMask are considered
  * @param mask
  */
 void listenForGestureEvents(uint32_t mask);
+void listenForGestureEventsInContext(GestureContext* context, uint32_t mask);
+/**
+ * Only events with mask contained by mask will have their distance, displacement
+ * and duration flags and their centroid, scale and rotation computed; the rest
+ * leave them zero. By default all events have them
+ * @param mask
+ */
+void computeDerivedFields(uint32_t mask);
+void computeDerivedFieldsInContext(GestureContext* context, uint32_t mask);
 
 /**
  * Types of gestures
@@ -105,21 +116,22 @@ GestureType getRot90Direction(GestureType d);
  * @return d rotated 270 deg
  */
 GestureType getRot270Direction(GestureType d);
+/**
+ * The GestureType each type becomes under each TransformMask. Only directions
+ * are changed; a combination of masks that isn't a transform turns every type
+ * into GESTURE_UNKNOWN
+ */
+extern const uint8_t gestureTransformTables[16][16];
 /**
  * Transforms type according to mask
  *
  * @param mask
  * @param type
  *
- * @return
+ * @return the transformed type or GESTURE_UNKNOWN if mask isn't a transform
  */
 static inline GestureType getReflection(TransformMasks mask, GestureType type) {
-    return mask == MirroredXMask ? getMirroredXDirection(type)
-        : mask == MirroredYMask ? getMirroredYDirection(type)
-        : mask == MirroredMask ? getOppositeDirection(type)
-        : mask == Rotate90Mask ? getRot90Direction(type)
-        : mask == Rotate270Mask ? getRot270Direction(type)
-        : GESTURE_UNKNOWN;
+    return gestureTransformTables[mask & 0xF][type & 0xF];
 }
 
 /// special flags specific to gestures
@@ -144,22 +156,122 @@ typedef struct GestureFlags {
     GestureMask mask ;
 } GestureFlags ;
 
-typedef GestureType GestureDetail[MAX_GESTURE_DETAIL_SIZE];
+/// The contribution of type at index N to the hash of a GestureDetail
+#define GESTURE_DETAIL_HASH_TERM(N, type) ((uint32_t)(type) * ((uint32_t)(2 * (N) + 1) * 0x9E3779B1u))
+
+/**
+ * An ordered list of GestureTypes.
+ *
+ * Types are packed 2 per byte; the Nth type is stored in the low nibble of
+ * packed[N/2] if N is even and the high nibble otherwise. Nibbles past size are
+ * always 0 so details can be compared bytewise.
+ *
+ * Use GESTURE_DETAIL to declare one and appendGestureType to build one at runtime.
+ */
+typedef struct {
+    /// sum of GESTURE_DETAIL_HASH_TERM over every type; maintained as types are added
+    uint32_t hash;
+    /// the number of types
+    uint8_t size;
+    uint8_t packed[MAX_GESTURE_DETAIL_SIZE / 2];
+} GestureDetail;
+
+/**
+ * Initializer for a GestureDetail from a list of up to 16 GestureTypes; more
+ * fail to compile
+ * ex: GestureDetail detail = GESTURE_DETAIL(GESTURE_NORTH, GESTURE_EAST);
+ */
+#define GESTURE_DETAIL(...) GESTURE_DETAIL_N(GESTURE_DETAIL_CHECK_COUNT(__VA_ARGS__), \
+        __VA_ARGS__, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)
+/// 0, or a negative array size error if given more than 16 arguments
+#define GESTURE_DETAIL_CHECK_COUNT(...) (0 * sizeof(char[sizeof((int[]) {__VA_ARGS__}) <= 16 * sizeof(int) ? 1 : -1]))
+#define GESTURE_DETAIL_N(CHECK, A0, A1, A2, A3, A4, A5, A6, A7, A8, A9, A10, A11, A12, A13, A14, A15, ...) { \
+    .hash = GESTURE_DETAIL_HASH_TERM(0, A0) + GESTURE_DETAIL_HASH_TERM(1, A1) + GESTURE_DETAIL_HASH_TERM(2, A2) + GESTURE_DETAIL_HASH_TERM(3, A3) + \
+        GESTURE_DETAIL_HASH_TERM(4, A4) + GESTURE_DETAIL_HASH_TERM(5, A5) + GESTURE_DETAIL_HASH_TERM(6, A6) + GESTURE_DETAIL_HASH_TERM(7, A7) + \
+        GESTURE_DETAIL_HASH_TERM(8, A8) + GESTURE_DETAIL_HASH_TERM(9, A9) + GESTURE_DETAIL_HASH_TERM(10, A10) + GESTURE_DETAIL_HASH_TERM(11, A11) + \
+        GESTURE_DETAIL_HASH_TERM(12, A12) + GESTURE_DETAIL_HASH_TERM(13, A13) + GESTURE_DETAIL_HASH_TERM(14, A14) + GESTURE_DETAIL_HASH_TERM(15, A15), \
+    .size = (CHECK) + !!(A0) + !!(A1) + !!(A2) + !!(A3) + !!(A4) + !!(A5) + !!(A6) + !!(A7) + !!(A8) + !!(A9) + !!(A10) + !!(A11) + !!(A12) + !!(A13) + !!(A14) + !!(A15), \
+    .packed = {(A0) | (A1) << 4, (A2) | (A3) << 4, \
+        (A4) | (A5) << 4, (A6) | (A7) << 4, \
+        (A8) | (A9) << 4, (A10) | (A11) << 4, \
+        (A12) | (A13) << 4, (A14) | (A15) << 4} \
+}
+
+/**
+ * @param detail
+ * @param N
+ * @return the Nth GestureType of detail
+ */
+static inline GestureType getGestureType(const GestureDetail detail, int N) {
+    return (detail.packed[N / 2] >> (N % 2 * 4)) & 0xF;
+}
+
+/**
+ * @param detail
+ * @return the number of GestureTypes in detail
+ */
+static inline int getNumOfTypes(const GestureDetail detail) {
+    return detail.size;
+}
+
+static inline bool areDetailsEqual(const GestureDetail detail, const GestureDetail detail2) {
+    return detail.size == detail2.size && detail.hash == detail2.hash &&
+        memcmp(detail.packed, detail2.packed, (detail.size + 1) / 2) == 0;
+}
 
-GestureType getGestureType(const GestureDetail detail, int N);
+/**
+ * Adds type to the end of detail
+ *
+ * @param detail
+ * @param type
+ *
+ * @return 1 iff there was room for type
+ */
+bool appendGestureType(GestureDetail* detail, GestureType type);
 
-int getNumOfTypes(const GestureDetail detail);
-bool areDetailsEqual(const GestureDetail detail, const GestureDetail detail2);
+/**
+ * Applies mask to every GestureType of detail
+ *
+ * @param detail the detail to modify
+ * @param mask
+ *
+ * @return detail
+ */
+GestureDetail* transformGestureDetail(GestureDetail* detail, const TransformMasks mask);
+/**
+ * Sets dest to src transformed by mask in one pass
+ *
+ * @param dest may be the same as src
+ * @param src
+ * @param mask
+ *
+ * @return dest
+ */
+GestureDetail* copyTransformedGestureDetail(GestureDetail* dest, const GestureDetail* src, TransformMasks mask);
 
 /**
- * Generates a list of gesture keybindings based on flags
+ * Classifies the line between every pair of consecutive points.
+ * Uses SIMD instructions when available.
+ *
+ * @param points
+ * @param num the number of points
+ * @param types set to the direction of each of the num - 1 lines
+ * @param sqDistances if not NULL, set to the squared length of each line
+ */
+void getLineTypes(const GesturePoint* points, uint32_t num, GestureType* types, uint32_t* sqDistances);
+/**
+ * Converts a whole stroke into directions exactly like a touch moving through
+ * points would be: points too close to the last accepted point are skipped and
+ * a direction is only added once it has been seen MIN_LINE_LEN times in a row.
  *
- * @param keyBinding
- * @param flags
+ * @param points
+ * @param num the number of points
+ * @param detail the directions are appended to this detail
+ * @param totalSqDistance the squared length of every accepted line is added to this value
  *
- * @return
+ * @return the number of accepted points
  */
-GestureType* transformGestureDetail(GestureDetail detail, const TransformMasks mask);
+uint32_t segmentStroke(const GesturePoint* points, uint32_t num, GestureDetail* detail, uint32_t* totalSqDistance);
 /**
  * @param t
  * @return string representation of t
@@ -0,0 +1,166 @@
+/**
+ * @file
+ *
+ * Shared memory ring used to broadcast TouchRecords from one writer to many readers.
+ *
+ * The writer owns a memfd holding a TouchRing and listens on a unix socket.
+ * Every reader that connects is sent the memfd and its own eventfd, which the
+ * writer signals after publishing a batch of records. Readers keep their own
+ * position in the ring so the writer never waits on them; a reader that falls
+ * more than capacity records behind skips the overwritten records.
+ */
+#ifndef LIB_SGESUTRES_RING_H_
+#define LIB_SGESUTRES_RING_H_
+
+#include <stddef.h>
+#include "touch.h"
+
+#define TOUCH_RING_MAGIC 0x47525453
+/// Number of records held by a ring unless otherwise specified; must be a power of 2
+#define DEFAULT_TOUCH_RING_CAPACITY 1024
+/// Max number of readers attached to a ring at once
+#define MAX_TOUCH_RING_READERS 16
+
+typedef struct {
+    /// 1 + the sequence number of record once it has been completely written
+    uint64_t seq;
+    TouchRecord record;
+} TouchRingSlot;
+
+typedef struct {
+    /// TOUCH_RING_MAGIC
+    uint32_t magic;
+    /// number of slots; a power of 2
+    uint32_t capacity;
+    /// set once the writer stops publishing
+    uint32_t closed;
+    /// names of the devices referenced by TouchRecords; updated before the first record that references them
+    DeviceRecord devices[MAX_STREAM_DEVICES];
+    /// number of records ever published
+    uint64_t writeSeq __attribute__((aligned(64)));
+    TouchRingSlot slots[] __attribute__((aligned(64)));
+} TouchRing;
+
+static inline size_t getTouchRingSize(uint32_t capacity) {
+    return sizeof(TouchRing) + capacity * sizeof(TouchRingSlot);
+}
+
+typedef struct TouchRingReader TouchRingReader;
+
+/**
+ * Connects to the writer listening on path and maps its ring.
+ * Only records published after this call will be read
+ *
+ * @param path the unix socket the writer is listening on
+ *
+ * @return a new reader or NULL on failure
+ */
+TouchRingReader* attachTouchRing(const char* path);
+/**
+ * @param reader
+ * @return an fd that is readable when new records have been published
+ */
+int getTouchRingFd(const TouchRingReader* reader);
+/**
+ * Waits until records are available and processes all of them
+ *
+ * @param reader
+ *
+ * @return the number of records processed, 0 if the writer closed the ring or -1 on error
+ */
+int readTouchRing(TouchRingReader* reader);
+/**
+ * Processes every record already published without waiting for more.
+ * Meant to be called whenever getTouchRingFd is readable in an event loop
+ *
+ * @param reader
+ *
+ * @return TOUCH_READ_AGAIN, TOUCH_READ_EOF if the writer closed the ring or TOUCH_READ_ERROR
+ */
+TouchReadStatus processPendingTouchRing(TouchRingReader* reader);
+/**
+ * @param reader
+ * @return the number of records that were overwritten before reader could process them
+ */
+uint64_t getTouchRingLostRecords(const TouchRingReader* reader);
+/**
+ * Unmaps the ring and frees reader
+ *
+ * @param reader
+ */
+void detachTouchRing(TouchRingReader* reader);
+
+/**
+ * Publishing side of a TouchRing
+ */
+typedef struct {
+    TouchRing* ring;
+    int memFd;
+    /// unix socket readers connect to in order to receive memFd
+    int listenFd;
+    const char* path;
+    uint32_t numReaders;
+    struct {
+        int socket;
+        /// signaled when records have been published
+        int eventFd;
+    } readers[MAX_TOUCH_RING_READERS];
+    /// true if records have been published since readers were last notified
+    bool pending;
+} TouchRingWriter;
+
+/**
+ * Creates a ring of capacity records and listens for readers on path
+ *
+ * @param writer
+ * @param path a unix socket path; any existing file is replaced
+ * @param capacity number of records; must be a power of 2
+ *
+ * @return 0 or -1 on error
+ */
+int createTouchRing(TouchRingWriter* writer, const char* path, uint32_t capacity);
+/**
+ * Accepts a pending connection on writer->listenFd and sends the new reader
+ * the ring, its eventfd and the sequence number of the next record
+ *
+ * @param writer
+ *
+ * @return 0 or -1 if the reader couldn't be added
+ */
+int acceptTouchRingReader(TouchRingWriter* writer);
+/**
+ * Stops notifying the i-th reader. The last reader takes its place
+ *
+ * @param writer
+ * @param i
+ */
+void removeTouchRingReader(TouchRingWriter* writer, uint32_t i);
+/**
+ * Sets the names readers will associate with record->device
+ *
+ * @param writer
+ * @param record
+ */
+void setTouchRingDevice(TouchRingWriter* writer, const DeviceRecord* record);
+/**
+ * Writes record into the next slot, overwriting the oldest record if the ring is full.
+ * Readers aren't woken until notifyTouchRingReaders is called
+ *
+ * @param writer
+ * @param record
+ */
+void publishTouchRecord(TouchRingWriter* writer, const TouchRecord* record);
+/**
+ * Wakes every reader if records have been published since the last call
+ *
+ * @param writer
+ */
+void notifyTouchRingReaders(TouchRingWriter* writer);
+/**
+ * Marks the ring as closed, wakes all readers and releases the writer's resources.
+ * Readers can continue to read what has already been published
+ *
+ * @param writer
+ */
+void closeTouchRing(TouchRingWriter* writer);
+#endif
@@ -0,0 +1,74 @@
+/**
+ * @file
+ * Copies the writer's stream from stdin to stdout while saving it with
+ * timestamps so it can later be replayed by sgestures-replay
+ *
+ * ex: sgestures-libinput-writer | sgestures-record capture | sgestures
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define RECORD_BUFFER_SIZE (1 << 12)
+
+static uint64_t getTimeNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Writes all size bytes of data to fd
+ *
+ * @return 0 on success or -1 on error
+ */
+static int writeAll(int fd, const void* data, size_t size) {
+    while(size) {
+        ssize_t ret = write(fd, data, size);
+        if(ret == -1) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        data = (const char*)data + ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+int main(int argc, char* const argv[]) {
+    if(argc != 2) {
+        fprintf(stderr, "Usage: %s CAPTURE_FILE\n", argv[0]);
+        return 2;
+    }
+    int captureFd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    TouchCaptureHeader header = {TOUCH_CAPTURE_MAGIC, TOUCH_CAPTURE_VERSION};
+    if(captureFd == -1 || writeAll(captureFd, &header, sizeof(header)) == -1) {
+        perror(argv[1]);
+        return 1;
+    }
+    static const char padding[8];
+    char buffer[RECORD_BUFFER_SIZE];
+    uint64_t start = getTimeNs();
+    while(1) {
+        ssize_t ret = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if(ret == -1 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return ret == -1;
+        TouchCaptureChunk chunk = {getTimeNs() - start, ret};
+        // the capture is written first so it has everything a crashing reader saw
+        if(writeAll(captureFd, &chunk, sizeof(chunk)) == -1 || writeAll(captureFd, buffer, ret) == -1 ||
+            writeAll(captureFd, padding, getTouchCaptureChunkSpan(ret) - sizeof(chunk) - ret) == -1) {
+            perror(argv[1]);
+            return 1;
+        }
+        if(writeAll(STDOUT_FILENO, buffer, ret) == -1)
+            return 1;
+    }
+}
@@ -0,0 +1,120 @@
+/**
+ * @file
+ * Feeds a capture made by sgestures-record through the recognizer without any
+ * touch hardware and reports how fast it was processed
+ *
+ * ex: sgestures-replay --speed 0 capture
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "event.h"
+#include "touch.h"
+
+static uint64_t gestureEventCount;
+static void countGesture(GestureEvent* event) {
+    gestureEventCount++;
+    releaseGestureEvent(event);
+}
+static void dumpAndCountGesture(GestureEvent* event) {
+    gestureEventCount++;
+    dumpAndFreeGesture(event);
+}
+
+static uint64_t getTimeNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleepUntil(uint64_t timeNs) {
+    struct timespec ts = {timeNs / 1000000000ULL, timeNs % 1000000000ULL};
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [--speed FACTOR] [--mask MASK] [--dump] CAPTURE_FILE\n"
+        "  --speed FACTOR  replay FACTOR times faster than recorded; 0 replays as fast as possible (default 1)\n"
+        "  --mask MASK     GestureMask of the events to generate (default all)\n"
+        "  --dump          print every generated event\n", name);
+}
+
+int main(int argc, char* const argv[]) {
+    double speed = 1;
+    uint32_t mask = -1;
+    bool dump = 0;
+    int i = 1;
+    for(; i < argc; i++) {
+        if(strcmp(argv[i], "--speed") == 0 && i + 1 < argc)
+            speed = atof(argv[++i]);
+        else if(strcmp(argv[i], "--mask") == 0 && i + 1 < argc)
+            mask = strtoul(argv[++i], NULL, 0);
+        else if(strcmp(argv[i], "--dump") == 0)
+            dump = 1;
+        else
+            break;
+    }
+    if(i + 1 != argc || speed < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    int fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    const char* capture = fd == -1 || fstat(fd, &st) == -1 || !st.st_size ? MAP_FAILED :
+        mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(capture == MAP_FAILED) {
+        perror(argv[i]);
+        return 1;
+    }
+    close(fd);
+    const TouchCaptureHeader* header = (const TouchCaptureHeader*)capture;
+    if((size_t)st.st_size < sizeof(*header) || header->magic != TOUCH_CAPTURE_MAGIC || header->version != TOUCH_CAPTURE_VERSION) {
+        fprintf(stderr, "%s: not a capture\n", argv[i]);
+        return 1;
+    }
+    listenForGestureEvents(mask);
+    registerEventHandler(dump ? dumpAndCountGesture : countGesture);
+
+    uint64_t touchEventCount = 0, chunkCount = 0, busyTime = 0, totalLag = 0;
+    uint64_t start = getTimeNs();
+    size_t offset = sizeof(*header);
+    while(offset + sizeof(TouchCaptureChunk) <= (size_t)st.st_size) {
+        const TouchCaptureChunk* chunk = (const TouchCaptureChunk*)(capture + offset);
+        if(offset + sizeof(*chunk) + chunk->size > (size_t)st.st_size) {
+            fprintf(stderr, "%s: truncated chunk at %zu\n", argv[i], offset);
+            break;
+        }
+        uint64_t due = speed ? start + chunk->time / speed : getTimeNs();
+        if(speed)
+            sleepUntil(due);
+        uint64_t before = getTimeNs();
+        int ret = processTouchEventBytes(chunk + 1, chunk->size);
+        uint64_t after = getTimeNs();
+        if(ret == -1) {
+            fprintf(stderr, "%s: malformed event in chunk at %zu\n", argv[i], offset);
+            return 1;
+        }
+        touchEventCount += ret;
+        busyTime += after - before;
+        totalLag += after - due;
+        chunkCount++;
+        offset += getTouchCaptureChunkSpan(chunk->size);
+    }
+    uint64_t wallTime = getTimeNs() - start;
+    fprintf(stderr, "chunks %lu touch events %lu gesture events %lu\n", (unsigned long)chunkCount,
+        (unsigned long)touchEventCount, (unsigned long)gestureEventCount);
+    fprintf(stderr, "wall %.3fms processing %.3fms %.0f events/s %.0fns/event avg chunk latency %.0fns\n",
+        wallTime / 1e6, busyTime / 1e6, busyTime ? touchEventCount * 1e9 / busyTime : 0,
+        touchEventCount ? (double)busyTime / touchEventCount : 0, chunkCount ? (double)totalLag / chunkCount : 0);
+    munmap((void*)capture, st.st_size);
+    return 0;
+}
@@ -11,7 +11,7 @@ recompile() {
     fi
     mkdir -p "$SGESTURES_DATA_DIR"
     # shellcheck disable=SC2086
-    ${CC:-cc} "$SGESTURES_HOME"/*.c -o "$SGESTURES_BIN" $CFLAGS $LDFLAGS -lsgestures -lm "$@"
+    ${CC:-cc} "$SGESTURES_HOME"/*.c -o "$SGESTURES_BIN" $CFLAGS $LDFLAGS -lsgestures -lm -pthread "$@"
 }
 
 if [ "$1" = "-r" ] || [ "$1" = "--recompile" ]; then
@@ -0,0 +1,274 @@
+/**
+ * @file
+ * Microbenchmarks of the recognizer's hot paths.
+ *
+ * Every benchmark prints a single JSON object on its own line so runs can be
+ * compared by other tools. Allocations are counted by wrapping malloc, calloc
+ * and realloc at link time (see the bench target of the Makefile).
+ *
+ * Usage: gesture-bench [NAME_PREFIX [MIN_MS]]
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../event.h"
+#include "../gestures-private.h"
+#include "../gestures.h"
+#include "../touch.h"
+
+static uint64_t allocations;
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t num, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void* __wrap_malloc(size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+void* __wrap_calloc(size_t num, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_calloc(num, size);
+}
+void* __wrap_realloc(void* ptr, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+static uint64_t getTimeNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/// Every benchmark is repeated for at least this long
+static uint64_t minTimeNs = 200 * 1000000ULL;
+/// Sink for values computed only to be measured
+static volatile uint64_t sink;
+
+static void releaseEvent(GestureEvent* event) {
+    sink += event->flags.mask;
+    releaseGestureEvent(event);
+}
+
+/**
+ * Runs a benchmark and prints its results
+ *
+ * @param name
+ * @param run does the work and returns the number of events it processed
+ * @param arg passed to run
+ */
+static void runBenchmark(const char* name, uint64_t (*run)(uint32_t arg), uint32_t arg) {
+    // the first run warms up the event pool and caches
+    run(arg);
+    uint64_t startAllocations = allocations;
+    uint64_t start = getTimeNs();
+    uint64_t events = 0, elapsed;
+    do
+        events += run(arg);
+    while((elapsed = getTimeNs() - start) < minTimeNs);
+    uint64_t allocated = allocations - startAllocations;
+    printf("{\"name\": \"%s\", \"arg\": %u, \"events\": %lu, \"ns\": %lu, \"ns_per_event\": %.2f, \"events_per_sec\": %.0f, \"allocs_per_event\": %.4f}\n",
+        name, arg, (unsigned long)events, (unsigned long)elapsed, events ? (double)elapsed / events : 0,
+        elapsed ? events * 1e9 / elapsed : 0, events ? (double)allocated / events : 0);
+    fflush(stdout);
+}
+
+static uint32_t timeCounter;
+
+/// Distance moved by a touch per event; just enough to be a new point
+#define STEP_SIZE 17
+/// Number of events per segment of a stroke; enough for the segment to be added as a direction
+#define SEGMENT_STEPS (MIN_LINE_LEN + 16)
+
+static const GesturePoint directions[] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+
+/**
+ * Moves up to 16 touches of device together through a stroke of the given
+ * number of segments, each segment turning 90 degrees from the last.
+ * With mirror, odd seats move mirrored along the x axis
+ *
+ * @return the number of touch events generated
+ */
+static uint64_t generateStroke(ProductID device, uint32_t fingers, uint32_t segments, bool mirror) {
+    GesturePoint points[16];
+    uint64_t events = 0;
+    for(uint32_t seat = 0; seat < fingers; seat++) {
+        points[seat] = (GesturePoint) {10000 + seat * 100, 10000};
+        startGesture((TouchEvent) {device, seat, points[seat], points[seat], timeCounter++}, "bench", "bench");
+        events++;
+    }
+    for(uint32_t segment = 0; segment < segments; segment++)
+        for(uint32_t step = 0; step < SEGMENT_STEPS; step++)
+            for(uint32_t seat = 0; seat < fingers; seat++) {
+                GesturePoint dir = directions[segment % LEN(directions)];
+                points[seat].x += (mirror && seat % 2 ? -dir.x : dir.x) * STEP_SIZE;
+                points[seat].y += dir.y * STEP_SIZE;
+                continueGesture((TouchEvent) {device, seat, points[seat], points[seat], timeCounter++});
+                events++;
+            }
+    for(uint32_t seat = 0; seat < fingers; seat++) {
+        endGesture((TouchEvent) {device, seat, points[seat], points[seat], timeCounter++});
+        events++;
+    }
+    return events;
+}
+
+/// arg is the number of fingers
+static uint64_t benchFingers(uint32_t fingers) {
+    return generateStroke(1, fingers, 4, 0);
+}
+
+/// arg is the number of fingers; half of them are mirrored so GestureEnd has to classify a reflection
+static uint64_t benchMirroredFingers(uint32_t fingers) {
+    return generateStroke(1, fingers, 4, 1);
+}
+
+/// arg is the number of segments
+static uint64_t benchLongStroke(uint32_t segments) {
+    return generateStroke(1, 1, segments, 0);
+}
+
+/// arg is the number of devices each with a 2 finger gesture in progress at once
+static uint64_t benchConcurrentDevices(uint32_t devices) {
+    uint64_t events = 0;
+    GesturePoint point = {10000, 10000};
+    for(uint32_t device = 0; device < devices; device++)
+        for(uint32_t seat = 0; seat < 2; seat++, events++)
+            startGesture((TouchEvent) {device + 1, seat, point, point, timeCounter++}, "bench", "bench");
+    for(uint32_t step = 0; step < SEGMENT_STEPS; step++)
+        for(uint32_t device = 0; device < devices; device++)
+            for(uint32_t seat = 0; seat < 2; seat++, events++) {
+                GesturePoint p = {point.x + (step + 1) * STEP_SIZE, point.y};
+                continueGesture((TouchEvent) {device + 1, seat, p, p, timeCounter++});
+            }
+    for(uint32_t device = 0; device < devices; device++)
+        for(uint32_t seat = 0; seat < 2; seat++, events++)
+            endGesture((TouchEvent) {device + 1, seat, point, point, timeCounter++});
+    return events;
+}
+
+void enqueueEvent(GestureEvent* event);
+
+#define NUM_ENQUEUED_EVENTS 1024
+/**
+ * Enqueues GestureEndMask events with a detail of size types, like the ones
+ * ending a mirrored_fingers gesture
+ *
+ * @return the number of events enqueued
+ */
+static uint64_t enqueueEndEvents(uint32_t size, TransformMasks reflectionMask) {
+    GestureEvent event = {.id = 1, .flags = {.fingers = 2, .mask = GestureEndMask, .reflectionMask = reflectionMask}};
+    for(uint32_t i = 0; i < size; i++)
+        appendGestureType(&event.detail, GESTURE_EAST + i % 8);
+    for(uint32_t i = 0; i < NUM_ENQUEUED_EVENTS; i++) {
+        GestureEvent* copy = borrowGestureEvent();
+        *copy = event;
+        enqueueEvent(copy);
+    }
+    return NUM_ENQUEUED_EVENTS;
+}
+
+/// arg is the size of the detail; the baseline of mirrored_fingers_reflection
+static uint64_t benchEnqueueEndEvent(uint32_t size) {
+    return enqueueEndEvents(size, TransformNone);
+}
+
+/// arg is the size of the detail; the difference from mirrored_fingers_enqueue is the cost of the reflected copy
+static uint64_t benchReflectEndEvent(uint32_t size) {
+    return enqueueEndEvents(size, MirroredXMask);
+}
+
+static GestureBindingArg* bindings;
+static GestureBindingRegistry* registry;
+#define NUM_BINDING_EVENTS 1024
+static GestureEvent bindingEvents[NUM_BINDING_EVENTS];
+
+static GestureDetail getRandomDetail() {
+    GestureDetail detail = {0};
+    uint32_t size = 1 + rand() % 4;
+    for(uint32_t i = 0; i < size; i++)
+        appendGestureType(&detail, GESTURE_EAST + rand() % 8);
+    return detail;
+}
+
+/**
+ * Creates num random bindings and events that match some of them
+ */
+static void setupBindings(uint32_t num) {
+    srand(num);
+    free(bindings);
+    bindings = malloc(sizeof(GestureBindingArg) * num);
+    for(uint32_t i = 0; i < num; i++) {
+        GestureBindingArg binding = {getRandomDetail(), {.fingers = 1 + rand() % 3}};
+        memcpy(&bindings[i], &binding, sizeof(binding));
+    }
+    for(uint32_t i = 0; i < NUM_BINDING_EVENTS; i++)
+        bindingEvents[i] = (GestureEvent) {
+            .id = 1,
+            .detail = i % 2 ? bindings[rand() % num].detail : getRandomDetail(),
+            .flags = {.fingers = 1 + rand() % 3, .mask = GestureEndMask},
+        };
+    if(registry)
+        freeGestureBindingRegistry(registry);
+    registry = createGestureBindingRegistry(bindings, num, sizeof(GestureBindingArg));
+}
+
+/// arg is the number of bindings, each checked against every event
+static uint64_t benchMatchBindings(uint32_t num) {
+    for(uint32_t i = 0; i < NUM_BINDING_EVENTS; i++)
+        for(uint32_t n = 0; n < num; n++)
+            sink += matchesGestureEvent(&bindings[n], &bindingEvents[i]);
+    return NUM_BINDING_EVENTS;
+}
+
+/// arg is the number of bindings, found through a registry
+static uint64_t benchFindBindings(uint32_t num __attribute__((unused))) {
+    uint32_t matches[16];
+    for(uint32_t i = 0; i < NUM_BINDING_EVENTS; i++)
+        sink += findGestureBindings(registry, &bindingEvents[i], matches, 16);
+    return NUM_BINDING_EVENTS;
+}
+
+static const char* prefix = "";
+static bool isSelected(const char* name) {
+    return strncmp(name, prefix, strlen(prefix)) == 0;
+}
+
+int main(int argc, char* const argv[]) {
+    if(argc > 1)
+        prefix = argv[1];
+    if(argc > 2)
+        minTimeNs = strtoull(argv[2], NULL, 10) * 1000000ULL;
+    registerEventHandler(releaseEvent);
+    const uint32_t fingers[] = {1, 2, 3, 5, 10};
+    for(uint32_t i = 0; i < LEN(fingers); i++) {
+        if(isSelected("fingers"))
+            runBenchmark("fingers", benchFingers, fingers[i]);
+        if(isSelected("mirrored_fingers") && fingers[i] > 1)
+            runBenchmark("mirrored_fingers", benchMirroredFingers, fingers[i]);
+    }
+    const uint32_t detailSizes[] = {4, MAX_GESTURE_DETAIL_SIZE};
+    for(uint32_t i = 0; i < LEN(detailSizes); i++) {
+        if(isSelected("mirrored_fingers_enqueue"))
+            runBenchmark("mirrored_fingers_enqueue", benchEnqueueEndEvent, detailSizes[i]);
+        if(isSelected("mirrored_fingers_reflection"))
+            runBenchmark("mirrored_fingers_reflection", benchReflectEndEvent, detailSizes[i]);
+    }
+    if(isSelected("long_stroke"))
+        runBenchmark("long_stroke", benchLongStroke, MAX_GESTURE_DETAIL_SIZE);
+    if(isSelected("concurrent_devices"))
+        runBenchmark("concurrent_devices", benchConcurrentDevices, 64);
+    const uint32_t bindingCounts[] = {16, 256, 4096};
+    for(uint32_t i = 0; i < LEN(bindingCounts); i++) {
+        if(!isSelected("match_bindings") && !isSelected("find_bindings"))
+            break;
+        setupBindings(bindingCounts[i]);
+        if(isSelected("match_bindings"))
+            runBenchmark("match_bindings", benchMatchBindings, bindingCounts[i]);
+        if(isSelected("find_bindings"))
+            runBenchmark("find_bindings", benchFindBindings, bindingCounts[i]);
+    }
+    return 0;
+}
@@ -1,13 +1,22 @@
+#define _GNU_SOURCE
 #define SCUTEST_DEFINE_MAIN
 #define SCUTEST_IMPLEMENTATION
 #include "scutest.h"
 #include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "../event.h"
 #include "../gestures-private.h"
 #include "../gestures.h"
 #include "../touch.h"
+#include "../writer.h"
 
 #define NULL_POINT ((GesturePoint){-1, -1})
 
@@ -60,6 +69,72 @@ SCUTEST_ITER(validate_dir, LEN(gestureTypeTuples)) {
     assert(values.type == getMirroredYDirection(getMirroredYDirection(values.type)));
 }
 
+SCUTEST(transform_tables) {
+    GestureType (*const transforms[16])(GestureType) = {
+        [MirroredXMask] = getMirroredXDirection, [MirroredYMask] = getMirroredYDirection, [MirroredMask] = getOppositeDirection,
+        [Rotate90Mask] = getRot90Direction, [Rotate270Mask] = getRot270Direction,
+    };
+    for(int mask = 0; mask < LEN(transforms); mask++)
+        for(GestureType type = 0; type < 16; type++) {
+            GestureType expected = mask && !transforms[mask] ? GESTURE_UNKNOWN : type < GESTURE_EAST || !mask ? type : transforms[mask](type);
+            assert(getReflection(mask, type) == (type ? expected : GESTURE_NONE));
+        }
+    GestureDetail detail = {};
+    srand(3);
+    for(int i = 0; i < MAX_GESTURE_DETAIL_SIZE - 1; i++)
+        appendGestureType(&detail, GESTURE_EAST + rand() % 8);
+    const TransformMasks masks[] = {MirroredXMask, MirroredYMask, MirroredMask, Rotate90Mask, Rotate270Mask};
+    for(int m = 0; m < LEN(masks); m++) {
+        GestureDetail expected = {};
+        for(int i = 0; i < getNumOfTypes(detail); i++)
+            appendGestureType(&expected, transforms[masks[m]](getGestureType(detail, i)));
+        GestureDetail transformed;
+        memset(&transformed, -1, sizeof(transformed));
+        copyTransformedGestureDetail(&transformed, &detail, masks[m]);
+        assert(areDetailsEqual(transformed, expected));
+        assert(memcmp(transformed.packed, expected.packed, sizeof(expected.packed)) == 0);
+        transformGestureDetail(&transformed, masks[m] & (Rotate90Mask | Rotate270Mask) ? masks[m] ^ (Rotate90Mask | Rotate270Mask) : masks[m]);
+        assert(areDetailsEqual(transformed, detail));
+    }
+}
+
+SCUTEST(gesture_detail_packing) {
+    GestureDetail detail = {};
+    GestureDetail expected = GESTURE_DETAIL(GESTURE_NORTH, GESTURE_EAST, GESTURE_SOUTH_WEST);
+    assert(!areDetailsEqual(detail, expected));
+    assert(appendGestureType(&detail, GESTURE_NORTH));
+    assert(appendGestureType(&detail, GESTURE_EAST));
+    assert(appendGestureType(&detail, GESTURE_SOUTH_WEST));
+    assert(getNumOfTypes(detail) == 3);
+    assert(getGestureType(detail, 1) == GESTURE_EAST);
+    assert(getGestureType(detail, 2) == GESTURE_SOUTH_WEST);
+    assert(areDetailsEqual(detail, expected));
+    assert(memcmp(&detail, &expected, sizeof(GestureDetail)) == 0);
+    transformGestureDetail(&detail, MirroredMask);
+    assert(areDetailsEqual(detail, (GestureDetail) GESTURE_DETAIL(GESTURE_SOUTH, GESTURE_WEST, GESTURE_NORTH_EAST)));
+}
+
+SCUTEST(gesture_detail_max_size) {
+    GestureDetail detail = {};
+    for(int i = 0; i < MAX_GESTURE_DETAIL_SIZE; i++)
+        assert(appendGestureType(&detail, GESTURE_EAST + i % 8));
+    assert(!appendGestureType(&detail, GESTURE_EAST));
+    assert(getNumOfTypes(detail) == MAX_GESTURE_DETAIL_SIZE);
+    for(int i = 0; i < MAX_GESTURE_DETAIL_SIZE; i++)
+        assert(getGestureType(detail, i) == GESTURE_EAST + i % 8);
+}
+
+SCUTEST(gesture_detail_initializer_max_args) {
+    GestureDetail detail = {};
+    for(int i = 0; i < 16; i++)
+        assert(appendGestureType(&detail, GESTURE_EAST + i % 8));
+    GestureDetail expected = GESTURE_DETAIL(GESTURE_EAST, GESTURE_NORTH_EAST, GESTURE_NORTH, GESTURE_NORTH_WEST,
+            GESTURE_WEST, GESTURE_SOUTH_WEST, GESTURE_SOUTH, GESTURE_SOUTH_EAST,
+            GESTURE_EAST, GESTURE_NORTH_EAST, GESTURE_NORTH, GESTURE_NORTH_WEST,
+            GESTURE_WEST, GESTURE_SOUTH_WEST, GESTURE_SOUTH, GESTURE_SOUTH_EAST);
+    assert(memcmp(&detail, &expected, sizeof(GestureDetail)) == 0);
+}
+
 GesturePoint lineDelta[] = {
     [GESTURE_TAP] = {0, 0},
     [GESTURE_EAST] = {1, 0},
@@ -79,6 +154,107 @@ SCUTEST_ITER(validate_line_type, LEN(lineDelta)) {
     }
 }
 
+/// getLineType as it was originally written with floating point math
+static GestureType getLineTypeReference(const GesturePoint start, const GesturePoint end) {
+#define SIGN_THRESHOLD(X) ((X)>.5?1:(X)>=-.5?0:-1)
+    double dx = end.x - start.x, dy = end.y - start.y;
+    double sum = sqrt(dx * dx + dy * dy);
+    int x = SIGN_THRESHOLD(dx / sum);
+    int y = SIGN_THRESHOLD(dy / sum);
+    return GESTURE_WEST + (2 + x) * y - (2 * x + 2) * (!y);
+}
+
+SCUTEST(line_type_matches_reference) {
+    const int range = 512;
+    for(int x = -range; x <= range; x++)
+        for(int y = -range; y <= range; y++) {
+            GesturePoint start = {x & 7, y & 3}, end = {start.x + x, start.y + y};
+            assert(getLineType(start, end) == getLineTypeReference(start, end));
+        }
+    const int32_t large[] = {1 << 20, 1 << 24, (1 << 30) - 1, INT32_MAX / 2, 181 * 181 * 181};
+    for(int i = 0; i < LEN(large); i++)
+        for(int j = -2; j <= 2; j++) {
+            GesturePoint deltas[] = {{large[i], j}, {j, large[i]}, {large[i], -large[i] + j}};
+            for(int n = 0; n < LEN(deltas); n++)
+                assert(getLineType((GesturePoint) {0, 0}, deltas[n]) == getLineTypeReference((GesturePoint) {0, 0}, deltas[n]));
+        }
+}
+
+/**
+ * Fills deltas with lines as close to 30 and 60 degrees as int32_t allows: the
+ * convergents p/q of sqrt(3), where p/q and q/p cross 4 * d^2 = dx^2 + dy^2,
+ * each in every quadrant and off by up to 1 in each direction
+ *
+ * @return the number of deltas
+ */
+static int getThirtyDegreeDeltas(GesturePoint* deltas) {
+    int num = 0;
+    // sqrt(3) = [1; 1, 2, 1, 2, ...]
+    int64_t p0 = 1, q0 = 0, p = 1, q = 1;
+    for(int i = 0; p <= INT32_MAX - 1; i++) {
+        for(int sx = -1; sx <= 1; sx += 2)
+            for(int sy = -1; sy <= 1; sy += 2)
+                for(int j = -1; j <= 1; j++) {
+                    deltas[num++] = (GesturePoint) {sx * q, sy * p + j};
+                    deltas[num++] = (GesturePoint) {sx * p + j, sy * q};
+                }
+        int64_t a = i % 2 ? 2 : 1;
+        int64_t p1 = a * p + p0, q1 = a * q + q0;
+        p0 = p, q0 = q, p = p1, q = q1;
+    }
+    return num;
+}
+
+/// getLineType computed independently with exact integer math
+static GestureType getLineTypeExact(const GesturePoint start, const GesturePoint end) {
+    int64_t dx = (int64_t)end.x - start.x, dy = (int64_t)end.y - start.y;
+    uint64_t dx2 = dx * dx, dy2 = dy * dy;
+    int x = 3 * dx2 > dy2 ? (dx > 0) - (dx < 0) : 0;
+    int y = 3 * dy2 > dx2 ? (dy > 0) - (dy < 0) : 0;
+    return GESTURE_WEST + (2 + x) * y - (2 * x + 2) * (!y);
+}
+
+SCUTEST(line_type_exact_near_30_degrees) {
+    static GesturePoint deltas[1 << 12];
+    int num = getThirtyDegreeDeltas(deltas);
+    assert(num > 0 && num < LEN(deltas));
+    // close enough to 60 degrees that the floating point version rounds to the other side
+    GesturePoint known[] = {{80198051, 138907099}, {299303201, 518408351}};
+    for(int i = 0; i < LEN(known); i++) {
+        assert(getLineType((GesturePoint) {0, 0}, known[i]) == getLineTypeExact((GesturePoint) {0, 0}, known[i]));
+        assert(getLineType((GesturePoint) {0, 0}, known[i]) != getLineTypeReference((GesturePoint) {0, 0}, known[i]));
+    }
+    for(int i = 0; i < num; i++)
+        assert(getLineType((GesturePoint) {0, 0}, deltas[i]) == getLineTypeExact((GesturePoint) {0, 0}, deltas[i]));
+    // the batch versions are checked with a path going out along each line and back to the origin
+    static GesturePoint points[2 * LEN(deltas) + 1];
+    static GestureType types[2 * LEN(deltas)];
+    for(int i = 0; i < num; i++)
+        points[2 * i + 1] = deltas[i];
+    getLineTypes(points, 2 * num + 1, types, NULL);
+    for(int i = 0; i < 2 * num; i++)
+        assert(types[i] == getLineTypeExact(points[i], points[i + 1]));
+}
+
+SCUTEST(batch_line_types) {
+    GesturePoint points[203];
+    GestureType types[LEN(points)];
+    uint32_t sqDistances[LEN(points)];
+    srand(2);
+    for(int i = 0; i < LEN(points); i++)
+        points[i] = (GesturePoint) {rand() % 2001 - 1000, rand() % 2001 - 1000};
+    points[7] = points[6];
+    points[50] = (GesturePoint) {INT32_MAX, INT32_MIN / 2};
+    for(int num = 0; num < LEN(points); num += num < 10 ? 1 : 37) {
+        getLineTypes(points, num, types, sqDistances);
+        for(int i = 1; i < num; i++) {
+            assert(types[i - 1] == getLineType(points[i - 1], points[i]));
+            uint32_t dx = (uint32_t)points[i].x - points[i - 1].x, dy = (uint32_t)points[i].y - points[i - 1].y;
+            assert(sqDistances[i - 1] == dx * dx + dy * dy);
+        }
+    }
+}
+
 static int FAKE_DEVICE_ID = 0;
 static unsigned int timeCounter = 0;
 static void continueGestureWrapper(ProductID id, int32_t seat, GesturePoint point) {
@@ -131,6 +307,26 @@ static void endGestureHelper(int fingers) {
         endGestureWrapper(FAKE_DEVICE_ID, n);
 }
 
+/**
+ * @return a v2 stream of the DeviceRecord for id at index device followed by records
+ */
+static TouchEventWriteBuffer* bufferTouchStream(uint32_t id, uint8_t device, const TouchRecord* records, int n) {
+    static TouchEventWriteBuffer writeBuffer;
+    writeBuffer.size = 0;
+    DeviceRecord deviceRecord = {.type = DeviceRecordType, .device = device, .id = id};
+    setDeviceRecordNames(&deviceRecord, "sysname", "name");
+    bufferTouchStreamHeader(-1, &writeBuffer);
+    bufferDeviceRecord(-1, &writeBuffer, &deviceRecord);
+    for(int i = 0; i < n; i++)
+        bufferTouchRecord(-1, &writeBuffer, &records[i]);
+    return &writeBuffer;
+}
+/// Writes all of the stream built by bufferTouchStream to fd
+static void writeTouchStream(int fd, uint32_t id, uint8_t device, const TouchRecord* records, int n) {
+    TouchEventWriteBuffer* writeBuffer = bufferTouchStream(id, device, records, n);
+    assert(write(fd, writeBuffer->buffer, writeBuffer->size) == writeBuffer->size);
+}
+
 static void freeGesture(GestureEvent* event) {
     assert(event->id != -1);
     memset(event, -1, sizeof(GestureEvent));
@@ -144,6 +340,23 @@ SCUTEST(free_gestures) {
     endGestureHelper(1);
 }
 
+static GestureEvent* lastReleasedEvent;
+static void releaseGesture(GestureEvent* event) {
+    lastReleasedEvent = event;
+    releaseGestureEvent(event);
+}
+
+SCUTEST(reuse_released_gestures) {
+    registerEventHandler(releaseGesture);
+    listenForGestureEvents(-1);
+    startGestureTap(0);
+    GestureEvent* event = lastReleasedEvent;
+    assert(event);
+    endGestureHelper(1);
+    assert(lastReleasedEvent == event);
+    assert(borrowGestureEvent() == event);
+}
+
 static GestureEvent* events[100];
 static int gestureEventCounterReader = 0;
 static int gestureEventCounterWriter = 0;
@@ -183,7 +396,7 @@ SCUTEST_ITER(start_continue_end_gesture_tap, 3) {
     for(int i = 0; i < 2 * n + 1; i ++) {
         GestureEvent* event = getNextGesture();
         assert(event);
-        assert(event->detail[0] == GESTURE_TAP);
+        assert(getGestureType(event->detail, 0) == GESTURE_TAP);
     }
 }
 
@@ -227,7 +440,7 @@ SCUTEST(many_points, .iter = 2) {
     endGestureHelper(1);
     GestureEvent* event = getNextGesture();
     assert(event);
-    assert(areDetailsEqual(event->detail, (GestureDetail) {GESTURE_SOUTH_EAST}));
+    assert(areDetailsEqual(event->detail, (GestureDetail) GESTURE_DETAIL(GESTURE_SOUTH_EAST)));
     assert(event->startPoint.x == points[0].x * SCALE_FACTOR);
     assert(event->startPoint.y == points[0].y * SCALE_FACTOR);
     assert(event->endPoint.x == points[1].x * SCALE_FACTOR);
@@ -250,6 +463,44 @@ SCUTEST(many_lines) {
 }
 
 
+SCUTEST(unselected_events_not_generated) {
+    listenForGestureEvents(GestureEndMask);
+    GesturePoint points[] = {{0, 0}, {1, 0}, {1, 1}, {2, 1}};
+    for(int i = 0; i < 2; i++) {
+        startGestureWithSteps(points, LEN(points), 0, 4);
+        endGestureHelper(1);
+    }
+    GestureEvent* first = getNextGesture();
+    GestureEvent* second = getNextGesture();
+    assert(first && second && !getNextGesture());
+    assert(second->seq == first->seq + 1);
+    assert(first->flags.avgSqDisplacement == 5 * SCALE_FACTOR * SCALE_FACTOR);
+    assert(first->flags.totalSqDistance == second->flags.totalSqDistance);
+    assert(getNumOfTypes(first->detail) == 3);
+}
+
+SCUTEST_ITER(segment_stroke, 3) {
+    listenForGestureEvents(TouchEndMask);
+    GesturePoint points[500];
+    srand(_i);
+    int step = (int[]) {4, 16, 64}[_i];
+    points[0] = (GesturePoint) {0, 0};
+    for(int i = 1; i < LEN(points); i++)
+        points[i] = (GesturePoint) {points[i - 1].x + rand() % step - step / 3, points[i - 1].y + rand() % step - step / 2};
+    startGestureWrapper(FAKE_DEVICE_ID, 0, points[0]);
+    for(int i = 1; i < LEN(points); i++)
+        continueGestureWrapper(FAKE_DEVICE_ID, 0, points[i]);
+    endGestureWrapper(FAKE_DEVICE_ID, 0);
+    GestureEvent* event = getNextGesture();
+    assert(event);
+    GestureDetail detail = {};
+    uint32_t totalSqDistance = 0;
+    assert(segmentStroke(points, LEN(points), &detail, &totalSqDistance) > 1);
+    assert(getNumOfTypes(event->detail) > 1);
+    assert(areDetailsEqual(event->detail, detail));
+    assert(event->flags.totalSqDistance == totalSqDistance);
+}
+
 SCUTEST(cancel_reset) {
     listenForGestureEvents(TouchCancelMask | GestureEndMask);
     startGestureTap(0);
@@ -265,22 +516,274 @@ SCUTEST(cancel_reset) {
     assert(event->flags.fingers == 1);
 }
 
+SCUTEST(cancel_updates_group_flags) {
+    listenForGestureEvents(GestureEndMask);
+    startGestureWrapper(FAKE_DEVICE_ID, 0, (GesturePoint) {0, 0});
+    continueGestureWrapper(FAKE_DEVICE_ID, 0, (GesturePoint) {SCALE_FACTOR, 0});
+    uint32_t start = timeCounter;
+    startGestureWrapper(FAKE_DEVICE_ID, 1, (GesturePoint) {0, 0});
+    continueGestureWrapper(FAKE_DEVICE_ID, 1, (GesturePoint) {0, SCALE_FACTOR});
+    continueGestureWrapper(FAKE_DEVICE_ID, 1, (GesturePoint) {SCALE_FACTOR, SCALE_FACTOR});
+    cancelGestureWrapper(FAKE_DEVICE_ID, 0);
+    uint32_t end = timeCounter;
+    endGestureWrapper(FAKE_DEVICE_ID, 1);
+    GestureEvent* event = getNextGesture();
+    assert(event->flags.fingers == 1);
+    assert(event->flags.duration == end - start);
+    assert(event->flags.totalSqDistance == 2 * SCALE_FACTOR * SCALE_FACTOR);
+    assert(event->flags.avgSqDistance == 2 * SCALE_FACTOR * SCALE_FACTOR);
+    assert(event->flags.avgSqDisplacement == 2 * SCALE_FACTOR * SCALE_FACTOR);
+}
+
+SCUTEST(derived_fields_only_for_mask) {
+    listenForGestureEvents(TouchMotionMask | GestureMotionMask | GestureEndMask);
+    computeDerivedFields(GestureEndMask);
+    startGestureWrapper(FAKE_DEVICE_ID, 0, (GesturePoint) {0, 0});
+    startGestureWrapper(FAKE_DEVICE_ID, 1, (GesturePoint) {0, 0});
+    continueGestureWrapper(FAKE_DEVICE_ID, 0, (GesturePoint) {SCALE_FACTOR, 0});
+    GestureEvent* event = getNextGesture();
+    assert(event->flags.mask == TouchMotionMask);
+    assert(!event->flags.totalSqDistance && !event->flags.avgSqDisplacement && !event->flags.duration);
+    event = getNextGesture();
+    assert(event->flags.mask == GestureMotionMask);
+    assert(event->scale == 0 && event->centroid.x == 0);
+    endGestureHelper(2);
+    event = getNextGesture();
+    assert(event->flags.mask == GestureEndMask);
+    assert(event->flags.totalSqDistance == SCALE_FACTOR * SCALE_FACTOR);
+    assert(event->flags.avgSqDistance == SCALE_FACTOR * SCALE_FACTOR / 2);
+    assert(event->centroid.x == SCALE_FACTOR / 2);
+}
+
+SCUTEST(read_buffered_touch_events) {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    LargestRawGestureEvent rawEvents[] = {
+        {{TouchStartMask, {FAKE_DEVICE_ID, 0, {0, 0}}}},
+        {{TouchStartMask, {FAKE_DEVICE_ID, 1, {0, 0}}}},
+        {{TouchMotionMask, {FAKE_DEVICE_ID, 0, {SCALE_FACTOR, 0}}}},
+        {{TouchEndMask, {FAKE_DEVICE_ID, 0}}},
+        {{TouchEndMask, {FAKE_DEVICE_ID, 1}}},
+    };
+    setRawGestureEventNames(&rawEvents[0], "sysname", "name");
+    char buffer[sizeof(rawEvents)];
+    int size = 0;
+    for(int i = 0; i < LEN(rawEvents); i++) {
+        int eventSize = sizeof(RawGestureEvent) + rawEvents[i].event.totalNameLen;
+        memcpy(buffer + size, &rawEvents[i], eventSize);
+        size += eventSize;
+    }
+    // split the stream in the middle of the 3rd event
+    int split = size - sizeof(RawGestureEvent) * 2 - 3;
+    assert(write(fds[1], buffer, split) == split);
+    assert(readTouchEvents(fds[0]) == split);
+    GestureEvent* event;
+    int count = 0;
+    while(event = getNextGesture()) {
+        assert(event->flags.mask == TouchStartMask);
+        count++;
+    }
+    assert(count == 2);
+    assert(write(fds[1], buffer + split, size - split) == size - split);
+    close(fds[1]);
+    assert(readTouchEvent(fds[0]) == 1);
+    assert(getNextGesture()->flags.mask == TouchMotionMask);
+    assert(getNextGesture()->flags.mask == GestureMotionMask);
+    assert(!getNextGesture());
+    assert(readTouchEvents(fds[0]) > 0);
+    assert(getNextGesture()->flags.mask == TouchEndMask);
+    assert(getNextGesture()->flags.mask == TouchEndMask);
+    assert(getNextGesture()->flags.mask == GestureEndMask);
+    assert(readTouchEvents(fds[0]) == 0);
+}
+
+SCUTEST(read_touch_records) {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    TouchRecord records[] = {
+        {TouchStartMask, 3, .touchEvent = {FAKE_DEVICE_ID, 0, {0, 0}}},
+        {TouchMotionMask, .touchEvent = {FAKE_DEVICE_ID, 0, {SCALE_FACTOR, 0}}},
+        {TouchEndMask, .touchEvent = {FAKE_DEVICE_ID, 0}},
+        {TouchStartMask, 3, .touchEvent = {FAKE_DEVICE_ID, 1, {0, 0}}},
+        {TouchCancelMask, .touchEvent = {FAKE_DEVICE_ID, 1}},
+        {TouchEndMask + 1},
+    };
+    TouchEventWriteBuffer* writeBuffer = bufferTouchStream(FAKE_DEVICE_ID, 3, records, LEN(records));
+    // only part of the header
+    assert(write(fds[1], writeBuffer->buffer, 3) == 3);
+    assert(readTouchEvents(fds[0]) == 3);
+    assert(!getNextGesture());
+    assert(write(fds[1], writeBuffer->buffer + 3, writeBuffer->size - 3) == writeBuffer->size - 3);
+    assert(readTouchEvents(fds[0]) == -1);
+    int masks[] = {TouchStartMask, TouchMotionMask, TouchEndMask, GestureEndMask, TouchStartMask, TouchCancelMask};
+    for(int i = 0; i < LEN(masks); i++)
+        assert(getNextGesture()->flags.mask == masks[i]);
+    assert(!getNextGesture());
+}
+
+SCUTEST(process_touch_event_bytes) {
+    TouchRecord records[] = {
+        {TouchStartMask, 1, .touchEvent = {FAKE_DEVICE_ID, 0, {0, 0}}},
+        {TouchMotionMask, .touchEvent = {FAKE_DEVICE_ID, 0, {SCALE_FACTOR, 0}}},
+        {TouchEndMask, .touchEvent = {FAKE_DEVICE_ID, 0}},
+    };
+    TouchEventWriteBuffer* writeBuffer = bufferTouchStream(FAKE_DEVICE_ID, 1, records, LEN(records));
+    int count = 0;
+    // every split of the stream is handled like a partial read
+    for(int i = 0; i < writeBuffer->size; i++)
+        count += processTouchEventBytes(writeBuffer->buffer + i, 1);
+    assert(count == LEN(records));
+    int masks[] = {TouchStartMask, TouchMotionMask, TouchEndMask, GestureEndMask};
+    for(int i = 0; i < LEN(masks); i++)
+        assert(getNextGesture()->flags.mask == masks[i]);
+    assert(!getNextGesture());
+    TouchRecord invalid = {TouchEndMask + 1};
+    assert(processTouchEventBytes(&invalid, sizeof(invalid)) == -1);
+}
+
+SCUTEST(process_pending_touch_events) {
+    int fds[2];
+    assert(pipe2(fds, O_NONBLOCK) == 0);
+    TouchRecord records[] = {
+        {TouchStartMask, 1, .touchEvent = {FAKE_DEVICE_ID, 0, {0, 0}}},
+        {TouchMotionMask, .touchEvent = {FAKE_DEVICE_ID, 0, {SCALE_FACTOR, 0}}},
+        {TouchEndMask, .touchEvent = {FAKE_DEVICE_ID, 0}},
+    };
+    TouchEventWriteBuffer* writeBuffer = bufferTouchStream(FAKE_DEVICE_ID, 1, records, LEN(records));
+    assert(processPendingTouchEvents(fds[0]) == TOUCH_READ_AGAIN);
+    assert(!getNextGesture());
+    // all but the last byte so the last record is incomplete
+    int size = writeBuffer->size - 1;
+    assert(write(fds[1], writeBuffer->buffer, size) == size);
+    assert(processPendingTouchEvents(fds[0]) == TOUCH_READ_AGAIN);
+    assert(getNextGesture()->flags.mask == TouchStartMask);
+    assert(getNextGesture()->flags.mask == TouchMotionMask);
+    assert(!getNextGesture());
+    assert(write(fds[1], writeBuffer->buffer + size, 1) == 1);
+    close(fds[1]);
+    assert(processPendingTouchEvents(fds[0]) == TOUCH_READ_EOF);
+    assert(getNextGesture()->flags.mask == TouchEndMask);
+    assert(getNextGesture()->flags.mask == GestureEndMask);
+    assert(!getNextGesture());
+    close(fds[0]);
+    assert(processPendingTouchEvents(fds[0]) == TOUCH_READ_ERROR);
+}
+
+SCUTEST(reject_unknown_stream_version) {
+    int fds[2];
+    assert(pipe2(fds, O_NONBLOCK) == 0);
+    TouchStreamHeader header = {TOUCH_STREAM_MAGIC, TOUCH_STREAM_VERSION + 1};
+    // a partial header is waited on
+    assert(write(fds[1], &header, sizeof(header) - 1) == sizeof(header) - 1);
+    assert(processPendingTouchEvents(fds[0]) == TOUCH_READ_AGAIN);
+    assert(write(fds[1], (char*)&header + sizeof(header) - 1, 1) == 1);
+    assert(processPendingTouchEvents(fds[0]) == TOUCH_READ_MALFORMED);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+SCUTEST(touch_event_merger) {
+    int window = 10;
+    struct {
+        int fds[2];
+        uint32_t times[2];
+    } sources[] = {{.times = {10, 30}}, {.times = {20, 40}}};
+    listenForGestureEvents(TouchStartMask);
+    TouchEventMerger* merger = createTouchEventMerger(window);
+    assert(merger);
+    for(int i = 0; i < LEN(sources); i++) {
+        assert(pipe2(sources[i].fds, O_NONBLOCK) == 0);
+        assert(addTouchEventSource(merger, sources[i].fds[0]) == 0);
+        TouchRecord records[LEN(sources[i].times)];
+        for(int n = 0; n < LEN(records); n++)
+            records[n] = (TouchRecord) {TouchStartMask, .touchEvent = {i + 1, n, .time = sources[i].times[n]}};
+        writeTouchStream(sources[i].fds[1], i + 1, 0, records, LEN(records));
+    }
+    while(gestureEventCounterWriter < 3)
+        assert(processTouchEventMerger(merger, 0) == TOUCH_READ_AGAIN);
+    // the newest record is held until the window passes
+    uint32_t expected[] = {10, 20, 30, 40};
+    for(int i = 0; i < 3; i++)
+        assert(getNextGesture()->time == expected[i]);
+    assert(!getNextGesture());
+    assert(getTouchEventMergerTimeout(merger) >= 0);
+    assert(processTouchEventMerger(merger, -1) == TOUCH_READ_AGAIN);
+    assert(getNextGesture()->time == expected[3]);
+    assert(getTouchEventMergerTimeout(merger) == -1);
+    for(int i = 0; i < LEN(sources); i++)
+        close(sources[i].fds[1]);
+    while(processTouchEventMerger(merger, 0) == TOUCH_READ_AGAIN);
+    assert(!getNextGesture());
+    for(int i = 0; i < LEN(sources); i++)
+        close(sources[i].fds[0]);
+    freeTouchEventMerger(merger);
+}
+
+SCUTEST(touch_event_merger_same_device) {
+    int fds[2][2];
+    listenForGestureEvents(TouchStartMask);
+    TouchEventMerger* merger = createTouchEventMerger(0);
+    assert(merger);
+    for(int i = 0; i < LEN(fds); i++) {
+        assert(pipe2(fds[i], O_NONBLOCK) == 0);
+        assert(addTouchEventSource(merger, fds[i][0]) == 0);
+        TouchRecord record = {TouchStartMask, .touchEvent = {FAKE_DEVICE_ID, 0, .time = i}};
+        writeTouchStream(fds[i][1], FAKE_DEVICE_ID, 0, &record, 1);
+        close(fds[i][1]);
+    }
+    while(processTouchEventMerger(merger, 0) == TOUCH_READ_AGAIN);
+    // the same device and seat on two writers are two touches
+    GestureEvent* event = getNextGesture();
+    assert(GESTURE_DEVICE_ID(event) == FAKE_DEVICE_ID);
+    event = getNextGesture();
+    assert(GESTURE_DEVICE_ID(event) == (FAKE_DEVICE_ID ^ 1 << MERGED_SOURCE_SHIFT));
+    assert(!getNextGesture());
+    for(int i = 0; i < LEN(fds); i++)
+        close(fds[i][0]);
+    freeTouchEventMerger(merger);
+}
+
+static int releasedEventCount;
+static void countAndReleaseGesture(GestureEvent* event) {
+    releasedEventCount++;
+    releaseGestureEvent(event);
+}
+SCUTEST(write_buffered_touch_events) {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    registerEventHandler(countAndReleaseGesture);
+    static TouchEventWriteBuffer writeBuffer;
+    LargestRawGestureEvent start = {{TouchStartMask, {FAKE_DEVICE_ID, 0}}};
+    LargestRawGestureEvent motion = {{TouchMotionMask, {FAKE_DEVICE_ID, 0}}};
+    setRawGestureEventNames(&start, "sysname", "name");
+    bufferTouchEvent(fds[1], &writeBuffer, &start.event);
+    int n = PIPE_BUF / sizeof(RawGestureEvent);
+    for(int i = 0; i < n; i++)
+        assert(bufferTouchEvent(fds[1], &writeBuffer, &motion.event) == sizeof(RawGestureEvent));
+    assert(writeBuffer.size && writeBuffer.size < PIPE_BUF);
+    assert(flushTouchEvents(fds[1], &writeBuffer) > 0);
+    assert(writeBuffer.size == 0);
+    close(fds[1]);
+    while(readTouchEvents(fds[0]) > 0);
+    assert(releasedEventCount == n + 1);
+}
+
 struct GestureEventChecker {
     GestureDetail detail;
 
     GesturePoint points[5];
 } gestureEventTuples[] = {
-    {{GESTURE_NORTH_WEST, GESTURE_SOUTH_WEST}, {{2, 2}, {1, 1}, {0, 2}, NULL_POINT }},
-    {{GESTURE_WEST}, {{1, 1}, {0, 1}, NULL_POINT}},
-    {{GESTURE_SOUTH_WEST, GESTURE_SOUTH_EAST}, {{1, 1}, {0, 2}, {1, 3}, NULL_POINT}},
-    {{GESTURE_NORTH}, {{1, 1}, {1, 0}, NULL_POINT}},
-    {{GESTURE_TAP}, {{1, 1}, NULL_POINT}},
-    {{GESTURE_TAP}, {{1, 1}, {1, 1}, NULL_POINT}},
-    {{GESTURE_SOUTH}, {{1, 1}, {1, 2}, NULL_POINT}},
-    {{GESTURE_NORTH_EAST, GESTURE_NORTH_WEST}, {{2, 2}, {3, 1}, {2, 0}, NULL_POINT}},
-    {{GESTURE_EAST}, {{1, 1}, {2, 1}, NULL_POINT}},
-    {{GESTURE_SOUTH_EAST, GESTURE_NORTH_EAST}, {{1, 1}, {2, 2}, {3, 1}, NULL_POINT}},
-    {{GESTURE_EAST}, {{0, 0}, {1, 0}, {2, 0}, {3, 0}, NULL_POINT}},
+    {GESTURE_DETAIL(GESTURE_NORTH_WEST, GESTURE_SOUTH_WEST), {{2, 2}, {1, 1}, {0, 2}, NULL_POINT }},
+    {GESTURE_DETAIL(GESTURE_WEST), {{1, 1}, {0, 1}, NULL_POINT}},
+    {GESTURE_DETAIL(GESTURE_SOUTH_WEST, GESTURE_SOUTH_EAST), {{1, 1}, {0, 2}, {1, 3}, NULL_POINT}},
+    {GESTURE_DETAIL(GESTURE_NORTH), {{1, 1}, {1, 0}, NULL_POINT}},
+    {GESTURE_DETAIL(GESTURE_TAP), {{1, 1}, NULL_POINT}},
+    {GESTURE_DETAIL(GESTURE_TAP), {{1, 1}, {1, 1}, NULL_POINT}},
+    {GESTURE_DETAIL(GESTURE_SOUTH), {{1, 1}, {1, 2}, NULL_POINT}},
+    {GESTURE_DETAIL(GESTURE_NORTH_EAST, GESTURE_NORTH_WEST), {{2, 2}, {3, 1}, {2, 0}, NULL_POINT}},
+    {GESTURE_DETAIL(GESTURE_EAST), {{1, 1}, {2, 1}, NULL_POINT}},
+    {GESTURE_DETAIL(GESTURE_SOUTH_EAST, GESTURE_NORTH_EAST), {{1, 1}, {2, 2}, {3, 1}, NULL_POINT}},
+    {GESTURE_DETAIL(GESTURE_EAST), {{0, 0}, {1, 0}, {2, 0}, {3, 0}, NULL_POINT}},
 };
 
 static void setupAsyncGesturesEnd() {
@@ -329,7 +832,7 @@ SCUTEST_ITER(validate_masks, LEN(gestureEventTuples)*LEN(MASKS)) {
     struct GestureEventChecker values = gestureEventTuples[index];
     static GesturePoint points[32];
     GestureBindingArg bindingBase = {};
-    memcpy((GestureType*)bindingBase.detail, values.detail, sizeof(GestureDetail));
+    memcpy((GestureDetail*)&bindingBase.detail, &values.detail, sizeof(GestureDetail));
     //GestureBinding bindingRefl = GestureBinding({values.detail}, {}, {.reflectionMask = mask}
     int N;
     N = getGesturePointsThatMakeLine(bindingBase.detail, points);
@@ -346,38 +849,38 @@ struct GestureMultiLineCheck {
 } multiLines[] = {
     {
         {{0, 0}, {1, 0}, {1, 1}, {0, 1}, {0, 0}, NULL_POINT},
-        {GESTURE_EAST, GESTURE_SOUTH, GESTURE_WEST, GESTURE_NORTH},
+        GESTURE_DETAIL(GESTURE_EAST, GESTURE_SOUTH, GESTURE_WEST, GESTURE_NORTH),
         .fingers = 1
     },
     {
         {{1, 1}, {2, 2}, {3, 1}, {2, 0}, {1, 1}, NULL_POINT},
-        {GESTURE_SOUTH_EAST, GESTURE_NORTH_EAST, GESTURE_NORTH_WEST, GESTURE_SOUTH_WEST},
+        GESTURE_DETAIL(GESTURE_SOUTH_EAST, GESTURE_NORTH_EAST, GESTURE_NORTH_WEST, GESTURE_SOUTH_WEST),
         .fingers = 1
     },
     {
         {{0, 0}, {1, 0}, {1, 1}, NULL_POINT},
-        {GESTURE_EAST, GESTURE_SOUTH},
+        GESTURE_DETAIL(GESTURE_EAST, GESTURE_SOUTH),
         .fingers = 2
     },
     {
         {{0, 0}, {1, 0}, {1, 1}, {0, 1}, {0, 0}, NULL_POINT},
-        {GESTURE_EAST, GESTURE_SOUTH, GESTURE_WEST, GESTURE_NORTH},
+        GESTURE_DETAIL(GESTURE_EAST, GESTURE_SOUTH, GESTURE_WEST, GESTURE_NORTH),
         .fingers = 2
     },
     {
         {{0, 0}, {1, 0}, {1, 1}, {0, 1}, {0, 0}, NULL_POINT},
-        {GESTURE_EAST, GESTURE_SOUTH, GESTURE_WEST, GESTURE_NORTH},
+        GESTURE_DETAIL(GESTURE_EAST, GESTURE_SOUTH, GESTURE_WEST, GESTURE_NORTH),
         .fingers = 1,
         .steps = 10
     },
     {
         {{0, 0}, {1, 0}, {1, 1}, {0, 1}, {0, 0}, NULL_POINT},
-        {GESTURE_EAST, GESTURE_SOUTH, GESTURE_WEST, GESTURE_NORTH},
+        GESTURE_DETAIL(GESTURE_EAST, GESTURE_SOUTH, GESTURE_WEST, GESTURE_NORTH),
         10, 10
     },
     {
         {{0, 0}, {1, 0}, {2, 0}, {3, 0}, {3, 3}, {3, 9}, NULL_POINT},
-        {GESTURE_EAST, GESTURE_SOUTH},
+        GESTURE_DETAIL(GESTURE_EAST, GESTURE_SOUTH),
         10, 10
     },
 };
@@ -402,7 +905,7 @@ struct GenericGestureCheck {
             {{1, 1}, {2, 1}},
             {{1, 1}, {0, 1}},
         },
-        {GESTURE_PINCH_OUT},
+        GESTURE_DETAIL(GESTURE_PINCH_OUT),
     },
     {
         {
@@ -411,7 +914,7 @@ struct GenericGestureCheck {
             {{2, 1}, {1, 1}},
             {{0, 1}, {1, 1}},
         },
-        {GESTURE_PINCH},
+        GESTURE_DETAIL(GESTURE_PINCH),
     },
     {
         {
@@ -420,7 +923,7 @@ struct GenericGestureCheck {
             {{4, 5}, {5, 6}},
             {{6, 7}, {7, 0}},
         },
-        {GESTURE_UNKNOWN},
+        GESTURE_DETAIL(GESTURE_UNKNOWN),
     },
     {
         {
@@ -429,7 +932,7 @@ struct GenericGestureCheck {
             {{2, 0}, NULL_POINT},
             {{2, 2}, {1, 1}},
         },
-        {GESTURE_UNKNOWN},
+        GESTURE_DETAIL(GESTURE_UNKNOWN),
     },
 };
 SCUTEST_ITER(generic_gesture, LEN(genericGesture)) {
@@ -442,6 +945,73 @@ SCUTEST_ITER(generic_gesture, LEN(genericGesture)) {
     assert(areDetailsEqual(event->detail, values.detail));
 }
 
+static inline double getSqDist(const GesturePoint a, const GesturePoint b) {
+    return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y);
+}
+
+/**
+ * Pinch classification as it was originally written: the average squared
+ * distance to the finger farthest from the centroids at the start and end
+ */
+static GestureType getPinchTypeReference(const GesturePoint* first, const GesturePoint* last, int n) {
+    GesturePoint avgStart = {0, 0}, avgEnd = {0, 0};
+    for(int i = 0; i < n; i++) {
+        ADD_POINT(avgStart, first[i]);
+        ADD_POINT(avgEnd, last[i]);
+    }
+    DIVIDE_POINT(avgStart, n);
+    DIVIDE_POINT(avgEnd, n);
+    int ref = 0;
+    double refDistance = -1;
+    for(int i = 0; i < n; i++) {
+        double dist = getSqDist(last[i], avgEnd) + getSqDist(first[i], avgStart);
+        if(dist > refDistance) {
+            refDistance = dist;
+            ref = i;
+        }
+    }
+    double avgStartDis = 0, avgEndDis = 0;
+    for(int i = 0; i < n; i++) {
+        avgEndDis += getSqDist(last[i], last[ref]);
+        avgStartDis += getSqDist(first[i], first[ref]);
+    }
+    avgEndDis /= n - 1;
+    avgStartDis /= n - 1;
+    double percentDiff = (avgStartDis - avgEndDis) * 2 / (avgStartDis + avgEndDis);
+    return percentDiff > PINCH_THRESHOLD_PERCENT ? GESTURE_PINCH : percentDiff < -PINCH_THRESHOLD_PERCENT ? GESTURE_PINCH_OUT : GESTURE_UNKNOWN;
+}
+
+SCUTEST(pinch_matches_reference) {
+    listenForGestureEvents(GestureEndMask);
+    srand(0);
+    int pinches = 0;
+    for(int iter = 0; iter < 2000; iter++) {
+        int n = 3 + rand() % 3;
+        GesturePoint first[5], last[5];
+        for(int i = 0; i < n; i++) {
+            first[i] = (GesturePoint) {1000 + rand() % 2000, 1000 + rand() % 2000};
+            last[i] = (GesturePoint) {1000 + rand() % 2000, 1000 + rand() % 2000};
+            startGestureWrapper(FAKE_DEVICE_ID, i, first[i]);
+            continueGestureWrapper(FAKE_DEVICE_ID, i, last[i]);
+        }
+        for(int i = 0; i < n; i++)
+            endGestureWrapper(FAKE_DEVICE_ID, i);
+        // a reflection is followed by its sibling
+        GestureEvent* event = getNextGesture();
+        assert(event);
+        GestureType type = getGestureType(event->detail, 0);
+        // otherwise the fingers were classified by their directions before being checked for a pinch
+        if(type == GESTURE_PINCH || type == GESTURE_PINCH_OUT || type == GESTURE_UNKNOWN) {
+            assert(type == getPinchTypeReference(first, last, n));
+            pinches += type != GESTURE_UNKNOWN;
+        }
+        for(int i = 0; i < gestureEventCounterWriter; i++)
+            releaseGestureEvent(events[i]);
+        gestureEventCounterReader = gestureEventCounterWriter = 0;
+    }
+    assert(pinches > 100);
+}
+
 struct GenericGestureBindingCheck {
     GesturePoint points[2][3];
     GestureBindingArg bindings[2];
@@ -452,8 +1022,8 @@ struct GenericGestureBindingCheck {
             {{2, 2}, {1, 1}, NULL_POINT},
         },
         {
-            {{GESTURE_NORTH_WEST}, {.fingers = 2, .reflectionMask = MirroredMask}},
-            {{GESTURE_SOUTH_EAST}, {.fingers = 2, .reflectionMask = MirroredMask}},
+            {GESTURE_DETAIL(GESTURE_NORTH_WEST), {.fingers = 2, .reflectionMask = MirroredMask}},
+            {GESTURE_DETAIL(GESTURE_SOUTH_EAST), {.fingers = 2, .reflectionMask = MirroredMask}},
         },
     },
     {
@@ -462,8 +1032,8 @@ struct GenericGestureBindingCheck {
             {{8, 8}, {7, 8}, {7, 9}},
         },
         {
-            {{GESTURE_WEST, GESTURE_SOUTH}, {.fingers = 2, .reflectionMask = MirroredXMask}},
-            {{GESTURE_EAST, GESTURE_SOUTH}, {.fingers = 2, .reflectionMask = MirroredXMask}},
+            {GESTURE_DETAIL(GESTURE_WEST, GESTURE_SOUTH), {.fingers = 2, .reflectionMask = MirroredXMask}},
+            {GESTURE_DETAIL(GESTURE_EAST, GESTURE_SOUTH), {.fingers = 2, .reflectionMask = MirroredXMask}},
         },
     },
     {
@@ -472,8 +1042,8 @@ struct GenericGestureBindingCheck {
             {{7, 9}, {7, 8}, {8, 8}},
         },
         {
-            {{GESTURE_NORTH, GESTURE_EAST}, {.fingers = 2, .reflectionMask = MirroredXMask}},
-            {{GESTURE_NORTH, GESTURE_WEST}, {.fingers = 2, .reflectionMask = MirroredXMask}},
+            {GESTURE_DETAIL(GESTURE_NORTH, GESTURE_EAST), {.fingers = 2, .reflectionMask = MirroredXMask}},
+            {GESTURE_DETAIL(GESTURE_NORTH, GESTURE_WEST), {.fingers = 2, .reflectionMask = MirroredXMask}},
         },
     },
     {
@@ -482,8 +1052,8 @@ struct GenericGestureBindingCheck {
             {{8, 8}, {8, 7}, {9, 7}},
         },
         {
-            {{GESTURE_NORTH, GESTURE_EAST}, {.fingers = 2, .reflectionMask = MirroredYMask}},
-            {{GESTURE_SOUTH, GESTURE_EAST}, {.fingers = 2, .reflectionMask = MirroredYMask}},
+            {GESTURE_DETAIL(GESTURE_NORTH, GESTURE_EAST), {.fingers = 2, .reflectionMask = MirroredYMask}},
+            {GESTURE_DETAIL(GESTURE_SOUTH, GESTURE_EAST), {.fingers = 2, .reflectionMask = MirroredYMask}},
         },
     },
 };
@@ -501,6 +1071,70 @@ SCUTEST_ITER(generic_gesture_binding, LEN(genericGestureBinding)) {
     assert(event);
     assert(matchesGestureEvent(&values.bindings[1], event));
 }
+SCUTEST(rotated_gesture_group) {
+    listenForGestureEvents(GestureEndMask);
+    GesturePoint points[][3] = {
+        {{8, 8}, {8, 9}, {9, 9}},
+        {{9, 9}, {9, 10}, {10, 10}},
+        {{8, 8}, {9, 8}, {9, 7}},
+    };
+    for(int i = 0; i < LEN(points); i++)
+        startGestureWithPoints(points[i], LEN(points[i]), i);
+    endGestureHelper(LEN(points));
+    GestureEvent* event = getNextGesture();
+    assert(event);
+    assert(event->flags.fingers == LEN(points));
+    assert(event->flags.reflectionMask == Rotate90Mask);
+}
+
+SCUTEST(unrelated_gesture_group) {
+    listenForGestureEvents(GestureEndMask);
+    GesturePoint points[][3] = {
+        {{8, 8}, {8, 9}, {9, 9}},
+        {{8, 8}, {7, 8}, {7, 7}},
+    };
+    for(int i = 0; i < LEN(points); i++)
+        startGestureWithPoints(points[i], LEN(points[i]), i);
+    endGestureHelper(LEN(points));
+    GestureEvent* event = getNextGesture();
+    assert(event);
+    assert(!event->flags.reflectionMask);
+    assert(getNumOfTypes(event->detail) == 1);
+}
+
+SCUTEST(group_motion_not_selected_by_default) {
+    GestureContext* context = createGestureContext();
+    assert(context->selectMask == ~(uint32_t)GestureMotionMask);
+    freeGestureContext(context);
+}
+
+SCUTEST(group_motion) {
+    listenForGestureEvents(GestureMotionMask | GestureEndMask);
+    startGestureWrapper(FAKE_DEVICE_ID, 0, multiplePoint((GesturePoint) {0, 0}, SCALE_FACTOR));
+    startGestureWrapper(FAKE_DEVICE_ID, 1, multiplePoint((GesturePoint) {10, 0}, SCALE_FACTOR));
+    continueGestureWrapper(FAKE_DEVICE_ID, 1, multiplePoint((GesturePoint) {20, 0}, SCALE_FACTOR));
+    GestureEvent* event = getNextGesture();
+    assert(event->flags.mask == GestureMotionMask);
+    assert(fabs(event->scale - 2) < 1e-9);
+    assert(fabs(event->rotation) < 1e-9);
+    assert(event->centroid.x == 10 * SCALE_FACTOR && event->centroid.y == 0);
+
+    continueGestureWrapper(FAKE_DEVICE_ID, 0, multiplePoint((GesturePoint) {5, -5}, SCALE_FACTOR));
+    continueGestureWrapper(FAKE_DEVICE_ID, 1, multiplePoint((GesturePoint) {5, 5}, SCALE_FACTOR));
+    getNextGesture();
+    event = getNextGesture();
+    assert(event->flags.mask == GestureMotionMask);
+    assert(fabs(event->scale - 1) < 1e-9);
+    assert(fabs(event->rotation - M_PI / 2) < 1e-9);
+    assert(event->centroid.x == 5 * SCALE_FACTOR && event->centroid.y == 0);
+
+    endGestureHelper(2);
+    event = getNextGesture();
+    assert(event->flags.mask == GestureEndMask);
+    assert(fabs(event->rotation - M_PI / 2) < 1e-9);
+    assert(!getNextGesture());
+}
+
 static int count;
 static void incrementCount() {
     count++;
@@ -510,16 +1144,16 @@ static int getCount() {
 }
 
 
-GestureEvent event = {.detail = {GESTURE_TAP}};
+GestureEvent event = {.detail = GESTURE_DETAIL(GESTURE_TAP)};
 struct GestureBindingEventMatching {
     GestureEvent event;
     GestureBinding binding;
     int count;
 } gestureBindingEventMatching [] = {
-    {{.detail = {GESTURE_TAP}, .flags = {.fingers = 1, }}, {incrementCount, {{GESTURE_TAP}, {.fingers = 1}}}, 1},
-    {{.detail = {GESTURE_TAP}, .flags = {.fingers = 2, }}, {incrementCount, {{GESTURE_TAP}, {.fingers = 1}}}, 0},
-    {{.detail = {GESTURE_TAP}, .flags = {.fingers = 2, }}, {incrementCount, {{GESTURE_TAP}, {.fingers = 2}}}, 1},
-    {{.detail = {GESTURE_TAP}, .flags = {.fingers = 1, }}, {incrementCount, {{GESTURE_UNKNOWN}, {.fingers = 1}}}, 0},
+    {{.detail = GESTURE_DETAIL(GESTURE_TAP), .flags = {.fingers = 1, }}, {incrementCount, {GESTURE_DETAIL(GESTURE_TAP), {.fingers = 1}}}, 1},
+    {{.detail = GESTURE_DETAIL(GESTURE_TAP), .flags = {.fingers = 2, }}, {incrementCount, {GESTURE_DETAIL(GESTURE_TAP), {.fingers = 1}}}, 0},
+    {{.detail = GESTURE_DETAIL(GESTURE_TAP), .flags = {.fingers = 2, }}, {incrementCount, {GESTURE_DETAIL(GESTURE_TAP), {.fingers = 2}}}, 1},
+    {{.detail = GESTURE_DETAIL(GESTURE_TAP), .flags = {.fingers = 1, }}, {incrementCount, {GESTURE_DETAIL(GESTURE_UNKNOWN), {.fingers = 1}}}, 0},
 };
 SCUTEST_ITER(gesture_matching, LEN(gestureBindingEventMatching)) {
     struct GestureBindingEventMatching values = gestureBindingEventMatching[_i];
@@ -545,6 +1179,450 @@ SCUTEST(differentiate_devices) {
     assert(getCount() == 2);
 }
 
+SCUTEST(binding_registry) {
+    static GestureBinding bindings[300];
+    GestureDetail details[] = {{}, GESTURE_DETAIL(GESTURE_TAP), GESTURE_DETAIL(GESTURE_NORTH, GESTURE_EAST), GESTURE_DETAIL(GESTURE_EAST, GESTURE_NORTH)};
+    GestureMask masks[] = {0, GestureEndMask, TouchEndMask, GestureEndMask | TouchEndMask, TouchMotionMask};
+    srand(1);
+    for(int i = 0; i < LEN(bindings); i++) {
+        GestureBindingArg arg = {details[rand() % LEN(details)],
+            {.fingers = rand() % 4, .duration = rand() % 3 * 100, .reflectionMask = rand() % 3, .mask = masks[rand() % LEN(masks)]},
+            {.fingers = rand() % 3 ? 0 : 3 + rand() % 2, .duration = rand() % 3 * 200}, rand() % 3, rand() % 3};
+        memcpy(&bindings[i].arg, &arg, sizeof(arg));
+    }
+    GestureBindingRegistry* registry = createGestureBindingRegistry(&bindings[0].arg, LEN(bindings), sizeof(bindings[0]));
+    int totalMatches = 0;
+    for(int n = 0; n < 2000; n++) {
+        GestureEvent event = {.id = (uint64_t)(rand() % 3) << 32 | rand() % 3, .detail = details[rand() % LEN(details)],
+            .flags = {.fingers = rand() % 5, .duration = rand() % 500, .reflectionMask = rand() % 3, .mask = masks[1 + rand() % (LEN(masks) - 2)]}};
+        uint32_t matches[LEN(bindings)];
+        uint32_t numMatches = findGestureBindings(registry, &event, matches, LEN(matches));
+        uint32_t expected = 0;
+        for(int i = 0; i < LEN(bindings); i++)
+            if(matchesGestureEvent(&bindings[i].arg, &event)) {
+                assert(expected < numMatches && matches[expected] == i);
+                expected++;
+            }
+        assert(expected == numMatches);
+        totalMatches += numMatches;
+        if(numMatches > 1) {
+            uint32_t first = matches[0];
+            assert(findGestureBindings(registry, &event, matches, 1) == 1 && matches[0] == first);
+        }
+    }
+    assert(totalMatches > 100);
+    freeGestureBindingRegistry(registry);
+}
+
+SCUTEST(gesture_prefix_match) {
+    GestureBindingArg bindings[] = {
+        {GESTURE_DETAIL(GESTURE_NORTH, GESTURE_EAST)},
+        {GESTURE_DETAIL(GESTURE_NORTH, GESTURE_WEST), {.fingers = 1}},
+        {GESTURE_DETAIL(GESTURE_NORTH, GESTURE_WEST), {.fingers = 2}},
+        {GESTURE_DETAIL(GESTURE_SOUTH)},
+        {{}, {.fingers = 1}},
+    };
+    GestureBindingRegistry* registry = createGestureBindingRegistry(bindings, LEN(bindings), sizeof(bindings[0]));
+    listenForGesturePrefixes(registry);
+    listenForGestureEvents(GestureMatchMask | GestureNoMatchMask);
+    GesturePoint northEast[] = {{0, 0}, {0, -1}, {1, -1}, {1, 0}};
+    startGestureWithPoints(northEast, 3, 0);
+    GestureEvent* event = getNextGesture();
+    assert(event && event->flags.mask == GestureMatchMask);
+    assert(areDetailsEqual(event->detail, bindings[0].detail));
+    // already resolved
+    continueGestureWrapper(FAKE_DEVICE_ID, 0, multiplePoint(northEast[3], SCALE_FACTOR));
+    assert(!getNextGesture());
+    endGestureWrapper(FAKE_DEVICE_ID, 0);
+
+    GesturePoint northWest[] = {{1, 1}, {1, 0}, {0, 0}};
+    startGestureWithPoints(northWest, LEN(northWest), 1);
+    event = getNextGesture();
+    assert(event && event->flags.mask == GestureMatchMask);
+    assert(areDetailsEqual(event->detail, bindings[1].detail));
+    endGestureWrapper(FAKE_DEVICE_ID, 1);
+
+    GesturePoint east[] = {{0, 0}, {1, 0}};
+    startGestureWithPoints(east, LEN(east), 2);
+    event = getNextGesture();
+    assert(event && event->flags.mask == GestureNoMatchMask);
+    assert(getGestureType(event->detail, 0) == GESTURE_EAST);
+    assert(!getNextGesture());
+    listenForGesturePrefixes(NULL);
+    freeGestureBindingRegistry(registry);
+}
+
+void enqueueEvent(GestureEvent* event);
+static int handlerPipe[2], resumePipe[2];
+static void waitAndReleaseGesture(GestureEvent* event) {
+    char c;
+    if(event->flags.mask == TouchStartMask)
+        assert(write(handlerPipe[1], "", 1) == 1 && read(resumePipe[0], &c, 1) == 1);
+    __atomic_add_fetch(&releasedEventCount, 1, __ATOMIC_RELAXED);
+    releaseGestureEvent(event);
+}
+static void enqueueEventWithMask(GestureMask mask) {
+    GestureEvent* event = borrowGestureEvent();
+    *event = (GestureEvent) {.flags = {.mask = mask}};
+    enqueueEvent(event);
+}
+SCUTEST(reflection_shares_event) {
+    setupAsyncGestures();
+    GestureEvent* event = borrowGestureEvent();
+    *event = (GestureEvent) {.detail = GESTURE_DETAIL(GESTURE_EAST), .flags = {.mask = GestureEndMask, .reflectionMask = MirroredXMask}};
+    uint64_t allocations = getGestureStats().allocations;
+    enqueueEvent(event);
+    assert(getNextGesture() == event);
+    GestureEvent* reflection = getNextGesture();
+    assert(reflection && reflection != event);
+    assert(areDetailsEqual(reflection->detail, (GestureDetail) GESTURE_DETAIL(GESTURE_WEST)));
+    assert(getGestureStats().allocations == allocations);
+    // the event is only reused once both have been released
+    releaseGestureEvent(event);
+    GestureEvent* next = borrowGestureEvent();
+    assert(next != event);
+    releaseGestureEvent(next);
+    releaseGestureEvent(reflection);
+    assert(borrowGestureEvent() == event);
+}
+
+SCUTEST(gesture_stats) {
+    registerEventHandler(releaseGestureEvent);
+    listenForGestureEvents(TouchStartMask | TouchEndMask);
+    startGestureTap(0);
+    endGestureWrapper(FAKE_DEVICE_ID, 0);
+    GestureStats stats = getGestureStats();
+    assert(stats.events[__builtin_ctz(TouchStartMask)] == 1);
+    assert(stats.events[__builtin_ctz(TouchEndMask)] == 1);
+    assert(stats.events[__builtin_ctz(GestureEndMask)] == 0);
+    // unselected events aren't even generated
+    assert(stats.unselected == 0);
+    assert(stats.allocations == 1);
+    uint64_t deviceEvents = 0, latencyCount = 0, handlerCount = 0;
+    for(int i = 0; i < MAX_GESTURE_STATS_DEVICES; i++)
+        if(stats.devices[i].id == FAKE_DEVICE_ID)
+            deviceEvents += stats.devices[i].events;
+    for(int i = 0; i < GESTURE_STATS_BUCKETS; i++) {
+        latencyCount += stats.latency[i];
+        handlerCount += stats.handlerTime[i];
+    }
+    assert(deviceEvents == 2);
+    assert(latencyCount == 2 && handlerCount == 2);
+
+    int fds[2];
+    assert(pipe(fds) == 0);
+    assert(dumpGestureStatsOnSignal(SIGUSR1, fds[1]) == 0);
+    raise(SIGUSR1);
+    close(fds[1]);
+    char buffer[4096] = {0};
+    int size = 0, ret;
+    while((ret = read(fds[0], buffer + size, sizeof(buffer) - 1 - size)) > 0)
+        size += ret;
+    assert(strstr(buffer, "events TouchStartMask 1\n"));
+    assert(strstr(buffer, "allocations 1\n"));
+}
+
+SCUTEST(handler_thread_full_queue) {
+    int queueSize = 1 << 10, extra = 5;
+    assert(pipe(handlerPipe) == 0 && pipe(resumePipe) == 0);
+    listenForGestureEvents(-1);
+    registerEventHandler(waitAndReleaseGesture);
+    assert(startEventHandlerThread() == 0);
+    enqueueEventWithMask(TouchStartMask);
+    char c;
+    // wait for the handler to be stuck on the first event
+    assert(read(handlerPipe[0], &c, 1) == 1);
+    for(int i = 0; i < queueSize + extra; i++)
+        enqueueEventWithMask(i % 2 ? TouchMotionMask : TouchHoldMask);
+    EventQueueStats stats = getEventQueueStats();
+    assert(stats.queued == queueSize + 1);
+    assert(stats.dropped == extra);
+    assert(stats.stalled == 0);
+    assert(write(resumePipe[1], "", 1) == 1);
+    enqueueEventWithMask(GestureEndMask);
+    stopEventHandlerThread();
+    assert(releasedEventCount == queueSize + 2);
+    stats = getEventQueueStats();
+    assert(stats.queued == queueSize + 2);
+    assert(stats.dropped == extra);
+}
+
+static uint32_t handledSeqs[16];
+static void waitAndSaveSeq(GestureEvent* event) {
+    char c;
+    if(event->flags.mask == TouchStartMask)
+        assert(write(handlerPipe[1], "", 1) == 1 && read(resumePipe[0], &c, 1) == 1);
+    handledSeqs[releasedEventCount++] = event->seq;
+    releaseGestureEvent(event);
+}
+SCUTEST(handler_thread_coalescing) {
+    struct {
+        GestureMask mask;
+        TouchID id;
+        bool handled;
+    } events[] = {
+        {TouchStartMask, 1, 1},
+        {TouchMotionMask, 1, 0},
+        {TouchMotionMask, 2, 0},
+        {TouchHoldMask, 1, 1},
+        {TouchMotionMask, 2, 1},
+        {TouchEndMask, 1, 1},
+        {TouchMotionMask, 1, 0},
+        {TouchMotionMask, 1, 1},
+        {TouchCancelMask, 2, 1},
+    };
+    assert(pipe(handlerPipe) == 0 && pipe(resumePipe) == 0);
+    listenForGestureEvents(-1);
+    registerEventHandler(waitAndSaveSeq);
+    coalesceMotionEvents(1);
+    assert(startEventHandlerThread() == 0);
+    for(int i = 0; i < LEN(events); i++) {
+        GestureEvent* event = borrowGestureEvent();
+        *event = (GestureEvent) {.seq = i, .lastEventId = events[i].id, .flags = {.mask = events[i].mask}};
+        enqueueEvent(event);
+        char c;
+        if(i == 0)
+            assert(read(handlerPipe[0], &c, 1) == 1);
+    }
+    assert(write(resumePipe[1], "", 1) == 1);
+    stopEventHandlerThread();
+    int expected = 0;
+    for(int i = 0; i < LEN(events); i++)
+        if(events[i].handled)
+            assert(handledSeqs[expected++] == i);
+    assert(releasedEventCount == expected);
+    assert(getEventQueueStats().merged == LEN(events) - expected);
+}
+
+SCUTEST(handler_thread_group_motion_coalescing) {
+    struct {
+        GestureMask mask;
+        GestureGroupID group;
+        TouchID id;
+        bool handled;
+    } events[] = {
+        {TouchStartMask, 1, 1, 1},
+        // group motion of the same touch doesn't stop its motion from being coalesced
+        {TouchMotionMask, 1, 1, 0},
+        {GestureMotionMask, 1, 1, 0},
+        {TouchMotionMask, 1, 1, 1},
+        // group motion is coalesced by group regardless of which touch moved
+        {GestureMotionMask, 1, 2, 1},
+        {TouchEndMask, 1, 2, 1},
+        {GestureMotionMask, 1, 1, 0},
+        {GestureMotionMask, 1, 1, 1},
+        {GestureMotionMask, 2, 3, 1},
+        {GestureEndMask, 1, 1, 1},
+    };
+    assert(pipe(handlerPipe) == 0 && pipe(resumePipe) == 0);
+    listenForGestureEvents(-1);
+    registerEventHandler(waitAndSaveSeq);
+    coalesceMotionEvents(1);
+    assert(startEventHandlerThread() == 0);
+    for(int i = 0; i < LEN(events); i++) {
+        GestureEvent* event = borrowGestureEvent();
+        *event = (GestureEvent) {.seq = i, .id = events[i].group, .lastEventId = events[i].id, .flags = {.mask = events[i].mask}};
+        enqueueEvent(event);
+        char c;
+        if(i == 0)
+            assert(read(handlerPipe[0], &c, 1) == 1);
+    }
+    assert(write(resumePipe[1], "", 1) == 1);
+    stopEventHandlerThread();
+    int expected = 0;
+    for(int i = 0; i < LEN(events); i++)
+        if(events[i].handled)
+            assert(handledSeqs[expected++] == i);
+    assert(releasedEventCount == expected);
+    assert(getEventQueueStats().merged == LEN(events) - expected);
+}
+
+static pthread_mutex_t shardedLock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t shardedEnds[3];
+static uint32_t shardedSeqs[1 << 10];
+static uint32_t shardedCount;
+static void saveShardedGesture(GestureEvent* event) {
+    pthread_mutex_lock(&shardedLock);
+    assert(shardedCount < LEN(shardedSeqs));
+    shardedSeqs[shardedCount++] = event->seq;
+    if(event->flags.mask == GestureEndMask)
+        shardedEnds[GESTURE_DEVICE_ID(event)]++;
+    pthread_mutex_unlock(&shardedLock);
+    releaseGestureEvent(event);
+}
+static int compareSeqs(const void* a, const void* b) {
+    return *(const uint32_t*)a < *(const uint32_t*)b ? -1 : *(const uint32_t*)a > *(const uint32_t*)b;
+}
+SCUTEST(gesture_shards) {
+    int strokes = 16;
+    listenForGestureEvents(-1);
+    registerEventHandler(saveShardedGesture);
+    assert(startGestureShards(2) == 0);
+    // the records of both devices are interleaved like those of a shared stream
+    for(int i = 0; i < strokes; i++)
+        for(ProductID device = 1; device <= 2; device++) {
+            GesturePoint end = {SCALE_FACTOR, 0};
+            TouchRecord records[] = {
+                {TouchStartMask, .touchEvent = {device, 0, {0, 0}, {0, 0}, i * 3}},
+                {TouchMotionMask, .touchEvent = {device, 0, end, end, i * 3 + 1}},
+                {TouchEndMask, .touchEvent = {device, 0, end, end, i * 3 + 2}},
+            };
+            for(int n = 0; n < LEN(records); n++)
+                assert(processTouchRecord(&records[n], "sysname", "name") == 1);
+        }
+    stopGestureShards();
+    assert(shardedEnds[1] == strokes && shardedEnds[2] == strokes);
+    qsort(shardedSeqs, shardedCount, sizeof(uint32_t), compareSeqs);
+    for(uint32_t i = 1; i < shardedCount; i++)
+        assert(shardedSeqs[i - 1] != shardedSeqs[i]);
+    // records are processed synchronously again once the shards are stopped
+    TouchRecord start = {TouchStartMask, .touchEvent = {1, 0}};
+    uint32_t count = shardedCount;
+    processTouchRecord(&start, "sysname", "name");
+    assert(shardedCount == count + 1);
+}
+
+static uint32_t contextEnds[2];
+static uint32_t contextSeqs[2];
+static void saveContextGesture0(GestureEvent* event) {
+    contextEnds[0] += event->flags.mask == GestureEndMask;
+    contextSeqs[0] = event->seq;
+    releaseGestureEvent(event);
+}
+static void saveContextGesture1(GestureEvent* event) {
+    contextEnds[1] += event->flags.mask == GestureEndMask;
+    contextSeqs[1] = event->seq;
+    releaseGestureEvent(event);
+}
+static int contextStrokes = 64;
+static void* runContextStrokes(void* arg) {
+    GestureContext* context = arg;
+    GesturePoint end = {SCALE_FACTOR, 0};
+    for(int i = 0; i < contextStrokes; i++) {
+        startGestureInContext(context, (TouchEvent) {FAKE_DEVICE_ID, 0, {0, 0}, {0, 0}, i}, "sysname", "name");
+        continueGestureInContext(context, (TouchEvent) {FAKE_DEVICE_ID, 0, end, end, i});
+        endGestureInContext(context, (TouchEvent) {FAKE_DEVICE_ID, 0, end, end, i});
+    }
+    return NULL;
+}
+SCUTEST(gesture_contexts) {
+    GestureContext* contexts[] = {createGestureContext(), createGestureContext()};
+    assert(contexts[0] && contexts[1]);
+    registerEventHandlerInContext(contexts[0], saveContextGesture0);
+    registerEventHandlerInContext(contexts[1], saveContextGesture1);
+    listenForGestureEventsInContext(contexts[1], GestureEndMask);
+    // the same touch is independent in every context
+    startGestureInContext(contexts[0], (TouchEvent) {FAKE_DEVICE_ID, 0}, "sysname", "name");
+    startGestureInContext(contexts[1], (TouchEvent) {FAKE_DEVICE_ID, 0}, "sysname", "name");
+    cancelGestureInContext(contexts[0], (TouchEvent) {FAKE_DEVICE_ID, 0});
+    endGestureInContext(contexts[1], (TouchEvent) {FAKE_DEVICE_ID, 0});
+    assert(contextEnds[0] == 0 && contextEnds[1] == 1);
+    // every context numbers its own events
+    assert(contextSeqs[0] == 2 && contextSeqs[1] == 1);
+    assert(!getNextGesture());
+
+    pthread_t threads[2];
+    for(int i = 0; i < 2; i++)
+        assert(pthread_create(&threads[i], NULL, runContextStrokes, contexts[i]) == 0);
+    for(int i = 0; i < 2; i++)
+        pthread_join(threads[i], NULL);
+    assert(contextEnds[0] == contextStrokes && contextEnds[1] == contextStrokes + 1);
+    assert(contextSeqs[1] == contextStrokes + 1);
+    assert(!getNextGesture());
+    freeGestureContext(contexts[0]);
+    freeGestureContext(contexts[1]);
+}
+
+/**
+ * @return a socket path for a TouchRing; per process so concurrent runs don't
+ * replace each other's socket and kept valid for the writer until it is closed
+ */
+static const char* getTestRingPath() {
+    static char path[64];
+    snprintf(path, sizeof(path), "/tmp/.sgestures-test-ring-%d", (int)getpid());
+    return path;
+}
+
+SCUTEST(touch_ring_invalid_capacity) {
+    const char* path = getTestRingPath();
+    static TouchRingWriter writer;
+    assert(createTouchRing(&writer, path, 6) == 0);
+    pid_t pid = fork();
+    if(pid == 0) {
+        // a capacity that isn't a power of 2 can't be indexed by masking
+        assert(!attachTouchRing(path));
+        exit(0);
+    }
+    assert(acceptTouchRingReader(&writer) == 0);
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    closeTouchRing(&writer);
+}
+
+SCUTEST(touch_ring_lost_records) {
+    const char* path = getTestRingPath();
+    int capacity = 8, extra = 4;
+    int fds[2];
+    assert(pipe(fds) == 0);
+    static TouchRingWriter writer;
+    assert(createTouchRing(&writer, path, capacity) == 0);
+    pid_t pid = fork();
+    if(pid == 0) {
+        TouchRingReader* reader = attachTouchRing(path);
+        assert(reader);
+        listenForGestureEvents(TouchStartMask);
+        registerEventHandler(countAndReleaseGesture);
+        char c;
+        assert(read(fds[0], &c, 1) == 1);
+        assert(readTouchRing(reader) == capacity);
+        assert(getTouchRingLostRecords(reader) == extra);
+        assert(releasedEventCount == capacity);
+        assert(readTouchRing(reader) == 0);
+        assert(processPendingTouchRing(reader) == TOUCH_READ_EOF);
+        detachTouchRing(reader);
+        exit(0);
+    }
+    assert(acceptTouchRingReader(&writer) == 0);
+    DeviceRecord device = {.type = DeviceRecordType, .id = FAKE_DEVICE_ID};
+    setDeviceRecordNames(&device, "sysname", "name");
+    setTouchRingDevice(&writer, &device);
+    for(int i = 0; i < capacity + extra; i++) {
+        TouchRecord record = {TouchStartMask, .touchEvent = {FAKE_DEVICE_ID, i}};
+        publishTouchRecord(&writer, &record);
+    }
+    closeTouchRing(&writer);
+    assert(write(fds[1], "", 1) == 1);
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+SCUTEST(many_devices) {
+    listenForGestureEvents(GestureEndMask | TouchCancelMask);
+    int devices = 50, fingers = 3;
+    for(int d = 0; d < devices; d++)
+        for(int n = 0; n < fingers; n++)
+            startGestureWrapper(d, n, (GesturePoint) {0, 0});
+    for(int d = 0; d < devices; d += 2)
+        cancelGestureWrapper(d, 1);
+    for(int n = 0; n < fingers; n++)
+        for(int d = devices - 1; d >= 0; d--)
+            endGestureWrapper(d, n);
+    GestureEvent* event;
+    int cancelled = 0, ended = 0;
+    while(event = getNextGesture()) {
+        if(event->flags.mask == TouchCancelMask)
+            cancelled++;
+        else {
+            assert(event->flags.fingers == (GESTURE_DEVICE_ID(event) % 2 ? fingers : fingers - 1));
+            ended++;
+        }
+    }
+    assert(cancelled == devices / 2);
+    assert(ended == devices);
+}
+
 static int counter = 0;
 ProductID generateIDHighBits(const TouchEvent* event) {
     assert(event);
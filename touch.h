@@ -18,8 +18,14 @@
 #define TouchMotionMask     (1 << 4)
 /// triggered when a touch is cancelled
 #define TouchCancelMask     (1 << 5)
+/// triggered when only one binding detail can still match a touch; the event's detail is the predicted one
+#define GestureMatchMask    (1 << 6)
+/// triggered when no binding detail can match a touch anymore
+#define GestureNoMatchMask  (1 << 7)
+/// triggered when a new point is added to a gesture of a group with multiple active touches
+#define GestureMotionMask   (1 << 8)
 /// @}
-typedef uint8_t GestureMask ;
+typedef uint16_t GestureMask ;
 
 
 /**
@@ -40,14 +46,154 @@ typedef struct TouchEvent {
     uint32_t time;
 } TouchEvent ;
 
+/**
+ * An independent recognizer with its own gestures in progress, selected events,
+ * handler, sequence numbers and stream buffer. Different contexts can be used by
+ * different threads at once but a context must only be used by one thread at a time.
+ *
+ * Every function that doesn't take a context uses the calling thread's current
+ * context, which is a default context shared by the whole process except while
+ * a function given a context is running (ie inside its event handler)
+ */
+typedef struct GestureContext GestureContext;
+/**
+ * @return a new context with the same defaults as the default context or NULL on error
+ */
+GestureContext* createGestureContext();
+/**
+ * Frees context and discards every gesture in progress in it.
+ * The default context can't be freed
+ */
+void freeGestureContext(GestureContext* context);
 
-bool readTouchEvent(uint32_t fd);
+
+/**
+ * Reads from fd until a complete event is available and processes it.
+ * Extra bytes that were read are kept for the next call
+ *
+ * @param fd
+ * @return 1 on success, 0 on EOF and -1 on error
+ */
+int readTouchEvent(uint32_t fd);
+int readTouchEventInContext(GestureContext* context, uint32_t fd);
+/**
+ * Does a single read of fd and processes every complete event received.
+ * An incomplete trailing event is kept until the rest of it is read.
+ * If complete events are still buffered from a previous call to readTouchEvent,
+ * they are processed instead and fd isn't read
+ *
+ * @param fd
+ * @return a positive value on success, 0 on EOF and -1 on error
+ */
+int readTouchEvents(uint32_t fd);
+int readTouchEventsInContext(GestureContext* context, uint32_t fd);
+/**
+ * Processes bytes of a stream that didn't come from an fd, such as a replayed
+ * capture, exactly like readTouchEvents would have had it read them.
+ * An incomplete trailing event is kept until the rest of it is given
+ *
+ * @param data
+ * @param size
+ * @return the number of complete events processed or -1 if a malformed event was found
+ */
+int processTouchEventBytes(const void* data, uint32_t size);
+/**
+ * Waits until fd is readable
+ *
+ * @param fd
+ * @return true if fd can be read without blocking
+ */
 bool isTouchEventReady(int32_t fd);
 
+/// Result of processing the events pending on an fd without blocking
+typedef enum {
+    /// everything available was processed; wait for the fd to be readable again
+    TOUCH_READ_AGAIN,
+    /// the writer closed the stream
+    TOUCH_READ_EOF,
+    /// reading failed; errno is set
+    TOUCH_READ_ERROR,
+    /// a malformed event was found; the stream can't be trusted past it
+    TOUCH_READ_MALFORMED,
+} TouchReadStatus;
+/**
+ * Reads fd until it has nothing left and processes every complete event read,
+ * so it can be called whenever an event loop reports fd as readable, including
+ * edge triggered epoll. An incomplete trailing event is kept for the next call.
+ * fd must be O_NONBLOCK; the call only returns once read fails with EAGAIN
+ *
+ * @param fd the non-blocking fd the writer's stream is read from
+ * @return TOUCH_READ_AGAIN once fd is drained or why processing stopped
+ */
+TouchReadStatus processPendingTouchEvents(int fd);
+TouchReadStatus processPendingTouchEventsInContext(GestureContext* context, int fd);
+
+/**
+ * Reads the streams of several writers at once, such as one per seat, and
+ * processes their records in TouchEvent::time order. A record is held until a
+ * record reorderWindow ms newer is read from any source or nothing has been
+ * read for reorderWindow ms, so records of a slow source are put back in order
+ * as long as they are less than reorderWindow ms late and never hold back the
+ * other sources for longer than that. The records of a source are always
+ * processed in the order they were written.
+ *
+ * Writers on different seats can report identical devices under the same
+ * ProductID, so the index of the source, in the order it was added, is xored
+ * into the high bits of the ProductID of its records; @see MERGED_SOURCE_SHIFT.
+ * The ids of the first source are unchanged.
+ *
+ * Records are processed in the calling thread's current context
+ */
+typedef struct TouchEventMerger TouchEventMerger;
+/// Shift of the source index xored into the ProductID of merged records
+#define MERGED_SOURCE_SHIFT 24
+/// Max number of sources of a TouchEventMerger
+#define MAX_MERGED_SOURCES (1 << (32 - MERGED_SOURCE_SHIFT))
+/**
+ * @param reorderWindow how long in ms records are held waiting for older ones
+ * @return a new merger or NULL on error
+ */
+TouchEventMerger* createTouchEventMerger(uint32_t reorderWindow);
+/**
+ * Adds a writer's stream to merger. fd must be O_NONBLOCK and is not closed by merger
+ *
+ * @return 0 or -1 on error or if merger already has MAX_MERGED_SOURCES
+ */
+int addTouchEventSource(TouchEventMerger* merger, int fd);
+/**
+ * @return an fd that is readable when a source is, for use in an event loop
+ */
+int getTouchEventMergerFd(const TouchEventMerger* merger);
+/**
+ * @return the ms until held records are due to be processed or -1 if none are held
+ */
+int getTouchEventMergerTimeout(const TouchEventMerger* merger);
+/**
+ * Waits up to timeout ms for a source to be readable, reads every readable
+ * source and processes the records that are due. Never waits past when held
+ * records are due. A source that is closed or fails is removed
+ *
+ * @param merger
+ * @param timeout max ms to wait; 0 to not wait and -1 to wait until a source is readable
+ * @return TOUCH_READ_AGAIN, TOUCH_READ_EOF once every source is closed and all of
+ * their records were processed or the failure of a source that was removed
+ */
+TouchReadStatus processTouchEventMerger(TouchEventMerger* merger, int timeout);
+/**
+ * Frees merger discarding any held records
+ */
+void freeTouchEventMerger(TouchEventMerger* merger);
+
+/**
+ * Version 1 of the stream format; a sequence of RawGestureEvents.
+ * Every TouchStart is followed by the sysname and name of its device, each NULL terminated
+ */
 typedef struct {
-    GestureMask mask;
+    /// a GestureMask; always a single byte in the stream
+    uint8_t mask;
     TouchEvent touchEvent;
-    char totalNameLen;
+    /// length of names including terminators
+    uint8_t totalNameLen;
     char names[];
 } RawGestureEvent;
 
@@ -56,6 +202,84 @@ typedef struct {
     char buffer[255];
 } LargestRawGestureEvent;
 
+/**
+ * Version 2 of the stream format starts with a TouchStreamHeader and is then a
+ * sequence of TouchRecords and DeviceRecords distinguished by their first byte.
+ *
+ * The names of a device are sent once in a DeviceRecord before the first
+ * TouchRecord that references it; TouchRecords only carry the device's index.
+ * A reader that doesn't see the header treats the stream as version 1.
+ */
+#define TOUCH_STREAM_MAGIC 0x54534753
+#define TOUCH_STREAM_VERSION 2
+typedef struct {
+    /// TOUCH_STREAM_MAGIC; "SGST" when little endian. 'S' is not a valid v1 mask
+    uint32_t magic;
+    uint32_t version;
+} TouchStreamHeader;
+
+/// Max number of devices a v2 stream can reference at once
+#define MAX_STREAM_DEVICES 256
+/// Type of a DeviceRecord; all other types are the GestureMask of a TouchRecord
+#define DeviceRecordType 0x80
+
+typedef struct {
+    /// One of TouchStartMask, TouchMotionMask, TouchEndMask or TouchCancelMask
+    uint8_t type;
+    /// index of the device in the device table; only meaningful for TouchStartMask
+    uint8_t device;
+    uint16_t reserved;
+    TouchEvent touchEvent;
+} TouchRecord;
+
+typedef struct {
+    /// DeviceRecordType
+    uint8_t type;
+    /// the index in the device table; an existing entry is replaced
+    uint8_t device;
+    uint16_t reserved;
+    uint32_t id;
+    char sysName[DEVICE_NAME_LEN];
+    char name[DEVICE_NAME_LEN];
+} DeviceRecord;
+
+/**
+ * Processes a single TouchRecord not read from a stream
+ *
+ * @param record
+ * @param sysName sysname of the record's device; only used for TouchStartMask
+ * @param name name of the record's device; only used for TouchStartMask
+ *
+ * @return 1 or -1 if the record's type is invalid
+ */
+int processTouchRecord(const TouchRecord* record, const char* sysName, const char* name);
+
+/**
+ * Processes the TouchEvents of each device on a thread of its own.
+ * Every record given to processTouchRecord (and so every record read from a
+ * stream) is handed to the shard of its device and applied there; each of the
+ * first maxShards devices gets a shard to itself after which devices share shards.
+ * The records of a device are always processed in order by the same shard.
+ *
+ * While shards are running the event handler is called concurrently from the
+ * shard threads unless the handler thread is running. GestureEvent::seq stays
+ * unique across all devices and increasing for the events of a device, but
+ * events of different devices may reach the handler out of seq order.
+ * Records must still only be processed by one thread at a time.
+ * Only the calling thread's current context is sharded and only one context can
+ * be sharded at once.
+ *
+ * @param maxShards max number of threads to start
+ * @return 0 or -1 if the shards couldn't be started
+ */
+int startGestureShards(uint32_t maxShards);
+/**
+ * Waits for every shard to process its queued records and stops them.
+ * Gestures still in progress are discarded and subsequent records are
+ * processed synchronously again
+ */
+void stopGestureShards();
+
 /**
  * Starts a gesture
  *
@@ -67,6 +291,7 @@ typedef struct {
  * @param name
  */
 void startGesture(const TouchEvent event, const char* sysName, const char* name);
+void startGestureInContext(GestureContext* context, const TouchEvent event, const char* sysName, const char* name);
 /**
  * Adds a point to a gesture
  *
@@ -76,6 +301,7 @@ void startGesture(const TouchEvent event, const char* sysName, const char* name)
  * @param lastGesturePoint
  */
 void continueGesture(const TouchEvent event);
+void continueGestureInContext(GestureContext* context, const TouchEvent event);
 /**
  * Concludes a gestures and if all gestures in the GestureGroup are done, termines the group and returns a GestureEvent.
  * The event is already added to the queue for processing
@@ -86,6 +312,7 @@ void continueGesture(const TouchEvent event);
  * @return NULL of a gesture event if all gestures have completed
  */
 void endGesture(const TouchEvent event);
+void endGestureInContext(GestureContext* context, const TouchEvent event);
 /**
  * Aborts and ongoing gesture
  *
@@ -95,4 +322,5 @@ void endGesture(const TouchEvent event);
  * @param seat
  */
 void cancelGesture(const TouchEvent event);
+void cancelGestureInContext(GestureContext* context, const TouchEvent event);
 #endif
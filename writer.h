@@ -1,20 +1,110 @@
 #ifndef LIB_SGESUTRES_WRITER_H_
 #define LIB_SGESUTRES_WRITER_H_
 
+#include "ring.h"
 #include "touch.h"
+#include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifndef PIPE_BUF
+#define PIPE_BUF 4096
+#endif
+
+static inline char* copyDeviceName(char* dest, const char* name) {
+    strncpy(dest, name, DEVICE_NAME_LEN - 1);
+    dest[DEVICE_NAME_LEN - 1] = 0;
+    return dest + strlen(dest) + 1;
+}
+
 void setRawGestureEventNames(LargestRawGestureEvent* event, const char* sysname, const char* devname) {
-    char* dest = strncpy(event->buffer, sysname, DEVICE_NAME_LEN);
-    *dest = 0;
-    dest = strncpy(dest + 1, devname, DEVICE_NAME_LEN);
-    *dest = 0;
+    char* dest = copyDeviceName(event->buffer, sysname);
+    dest = copyDeviceName(dest, devname);
     event->event.totalNameLen = dest - event->buffer;
 }
 
+void setDeviceRecordNames(DeviceRecord* record, const char* sysname, const char* devname) {
+    copyDeviceName(record->sysName, sysname);
+    copyDeviceName(record->name, devname);
+}
+
 int writeTouchEvent(int fd, const RawGestureEvent* event) {
     return write(fd, event, sizeof(RawGestureEvent) + event->totalNameLen);
 }
+
+/**
+ * Holds events that are written together by flushTouchEvents.
+ * The buffer is never larger than PIPE_BUF so each flush to a pipe is a single atomic write
+ */
+typedef struct {
+    char buffer[PIPE_BUF];
+    uint32_t size;
+} TouchEventWriteBuffer;
+
+/**
+ * Writes all buffered events to fd. Short writes are resumed so fd only ever sees whole events
+ *
+ * @param fd
+ * @param buffer
+ *
+ * @return the number of bytes written or -1 on error
+ */
+int flushTouchEvents(int fd, TouchEventWriteBuffer* buffer) {
+    uint32_t written = 0;
+    while(written < buffer->size) {
+        int ret = write(fd, buffer->buffer + written, buffer->size - written);
+        if(ret == -1) {
+            if(errno == EINTR)
+                continue;
+            buffer->size = 0;
+            return -1;
+        }
+        written += ret;
+    }
+    buffer->size = 0;
+    return written;
+}
+
+/**
+ * Appends size bytes of data to buffer, first flushing buffer to fd if they don't fit
+ *
+ * @param fd
+ * @param buffer
+ * @param data a complete event or record
+ * @param size
+ *
+ * @return size or -1 if a flush failed
+ */
+int bufferTouchData(int fd, TouchEventWriteBuffer* buffer, const void* data, uint32_t size) {
+    if(buffer->size + size > sizeof(buffer->buffer) && flushTouchEvents(fd, buffer) == -1)
+        return -1;
+    memcpy(buffer->buffer + buffer->size, data, size);
+    buffer->size += size;
+    return size;
+}
+
+/**
+ * Appends a version 1 event to buffer
+ * @see bufferTouchData
+ */
+int bufferTouchEvent(int fd, TouchEventWriteBuffer* buffer, const RawGestureEvent* event) {
+    return bufferTouchData(fd, buffer, event, sizeof(RawGestureEvent) + event->totalNameLen);
+}
+
+int bufferTouchStreamHeader(int fd, TouchEventWriteBuffer* buffer) {
+    TouchStreamHeader header = {TOUCH_STREAM_MAGIC, TOUCH_STREAM_VERSION};
+    return bufferTouchData(fd, buffer, &header, sizeof(header));
+}
+
+int bufferTouchRecord(int fd, TouchEventWriteBuffer* buffer, const TouchRecord* record) {
+    return bufferTouchData(fd, buffer, record, sizeof(*record));
+}
+
+int bufferDeviceRecord(int fd, TouchEventWriteBuffer* buffer, const DeviceRecord* record) {
+    return bufferTouchData(fd, buffer, record, sizeof(*record));
+}
+
 #endif